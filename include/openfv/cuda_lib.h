@@ -37,6 +37,8 @@
 
 #include <iostream>
 
+#include "refraction.h"
+
 using namespace cv;
 using namespace gpu;
 
@@ -45,21 +47,33 @@ typedef struct {
     float x, y, z;
 } point;
 
+// Center and row major projection matrix of a camera in the refractive model.
+// Passed to kernels by value so the number of cameras is not limited by the
+// size of constant memory.
+typedef struct {
+    float C[3];
+    float P[12];
+} refracCam;
+
 // Kernels
-__global__ void calc_refocus_map_kernel(PtrStepSzf xmap, PtrStepSzf ymap, float z, int n, int rows, int cols);
+__global__ void calc_refocus_map_kernel(PtrStepSzf xmap, PtrStepSzf ymap, float z, refracCam cam, int rows, int cols);
 
 __device__ point point_refrac(point Xcam, point p, float &f, float &g, float zW_, float n1_, float n2_, float n3_, float t_);
 
 __device__ point point_refrac_fast(point Xcam, point p, float &f, float &g);
 
+// Same as point_refrac_fast for the stack of layers in constant memory
+__device__ point point_refrac_layers(point Xcam, point p);
+
 __global__ void calc_nlca_image_fast(PtrStepSzf nlca_image, PtrStepSzf img1, PtrStepSzf img2, PtrStepSzf img3, PtrStepSzf img4, int rows, int cols, float sigma);
 
 __global__ void calc_nlca_image(PtrStepSzf nlca_image, PtrStepSzf img1, PtrStepSzf img2, PtrStepSzf img3, PtrStepSzf img4, int rows, int cols, int window, float sigma);
 
 // Host wrappers
-void uploadRefractiveData(float hinv[6], float locations[9][3], float pmats[9][12], float geom[5]);
+// geom holds REFRAC_GEOM_SIZE(layers) entries as described in refraction.h
+void uploadRefractiveData(float hinv[6], float* geom, int layers = 1);
 
-void gpu_calc_refocus_map(GpuMat &xmap, GpuMat &ymap, float z, int i, int rows, int cols);
+void gpu_calc_refocus_map(GpuMat &xmap, GpuMat &ymap, float z, const refracCam &cam, int rows, int cols);
 
 void gpu_calc_refocus_maps(vector<GpuMat> &xmaps, vector<GpuMat> &ymaps, float z);
 
@@ -25,6 +25,7 @@
 #define OPTIMIZATION_H
 
 #include "std_include.h"
+#include "refraction.h"
 
 using namespace cv;
 using namespace std;
@@ -595,13 +596,34 @@ class xyPlaneError {
 
 };
 
+// Find where the ray from c to point crosses the camera side face of the wall,
+// which spans z0-t to z0, with any further layers (index and thickness pairs)
+// between the wall and the scene
+template <typename T>
+void refrac_wall_point(const T* c, const T* point, double z0, double t, double n1, double n2, double n3, const vector<double> &layers, T* a) {
+
+    if (layers.empty()) {
+        refrac_point(c, point, T(z0-t), T(t), T(n1), T(n2), T(n3), a, 6);
+        return;
+    }
+
+    double g[REFRAC_GEOM_SIZE(REFRAC_MAX_LAYERS)] = {z0-t, n1, n2, n3, t};
+    for (int i=0; i<layers.size(); i++)
+        g[5+i] = layers[i];
+
+    refracLayers<T> L;
+    refrac_layers_setup(g, layers.size()/2 + 1, L);
+    refrac_layers_point(c, point, T(z0-t), L, a, 6);
+
+}
+
 // Refractive Reprojection Error function
 class refractiveReprojectionError {
 
  public:
 
- refractiveReprojectionError(double observed_x, double observed_y, double cx, double cy, int num_cams, double t, double n1, double n2, double n3, double z0)
-     : observed_x(observed_x), observed_y(observed_y), cx(cx), cy(cy), num_cams(num_cams), t_(t), n1_(n1), n2_(n2), n3_(n3), z0_(z0) { }
+ refractiveReprojectionError(double observed_x, double observed_y, double cx, double cy, int num_cams, double t, double n1, double n2, double n3, double z0, vector<double> layers = vector<double>())
+     : observed_x(observed_x), observed_y(observed_y), cx(cx), cy(cy), num_cams(num_cams), t_(t), n1_(n1), n2_(n2), n3_(n3), z0_(z0), layers_(layers) { }
 
     template <typename T>
         bool operator()(const T* const camera,
@@ -620,56 +642,9 @@ class refractiveReprojectionError {
             }
         }
 
-        // All the refraction stuff
-        T* a = new T[3];
-        T* b = new T[3];
-        a[0] = c[0] + (point[0]-c[0])*(T(-t_)+T(z0_)-c[2])/(point[2]-c[2]);
-        a[1] = c[1] + (point[1]-c[1])*(T(-t_)+T(z0_)-c[2])/(point[2]-c[2]);
-        a[2] = T(-t_)+T(z0_);
-        b[0] = c[0] + (point[0]-c[0])*(T(z0_)-c[2])/(point[2]-c[2]);
-        b[1] = c[1] + (point[1]-c[1])*(T(z0_)-c[2])/(point[2]-c[2]);
-        b[2] = T(z0_);
-
-        T rp = sqrt( pow(point[0]-c[0],2) + pow(point[1]-c[1],2) );
-        T dp = point[2]-b[2];
-        T phi = atan2(point[1]-c[1],point[0]-c[0]);
-
-        T ra = sqrt( pow(a[0]-c[0],2) + pow(a[1]-c[1],2) );
-        T rb = sqrt( pow(b[0]-c[0],2) + pow(b[1]-c[1],2) );
-        T da = a[2]-c[2];
-        T db = b[2]-a[2];
-
-        T f, g, dfdra, dfdrb, dgdra, dgdrb;
-
-        // Newton Raphson loop to solve for Snell's law
-        for (int i=0; i<20; i++) {
-
-            f = ( ra/sqrt(pow(ra,2)+pow(da,2)) ) - ( T(n2_/n1_)*(rb-ra)/sqrt(pow(rb-ra,2)+pow(db,2)) );
-            g = ( (rb-ra)/sqrt(pow(rb-ra,2)+pow(db,2)) ) - ( T(n3_/n2_)*(rp-rb)/sqrt(pow(rp-rb,2)+pow(dp,2)) );
-
-            dfdra = ( T(1.0)/sqrt(pow(ra,2)+pow(da,2)) )
-                - ( pow(ra,2)/pow(pow(ra,2)+pow(da,2),1.5) )
-                + ( T(n2_/n1_)/sqrt(pow(ra-rb,2)+pow(db,2)) )
-                - ( T(n2_/n1_)*(ra-rb)*(T(2)*ra-T(2)*rb)/(T(2)*pow(pow(ra-rb,2)+pow(db,2),1.5)) );
-
-            dfdrb = ( T(n2_/n1_)*(ra-rb)*(T(2)*ra-T(2)*rb)/(T(2)*pow(pow(ra-rb,2)+pow(db,2),1.5)) )
-                - ( T(n2_/n1_)/sqrt(pow(ra-rb,2)+pow(db,2)) );
-
-            dgdra = ( (ra-rb)*(T(2)*ra-T(2)*rb)/(T(2)*pow(pow(ra-rb,2)+pow(db,2),1.5)) )
-                - ( T(1.0)/sqrt(pow(ra-rb,2)+pow(db,2)) );
-
-            dgdrb = ( T(1.0)/sqrt(pow(ra-rb,2)+pow(db,2)) )
-                + ( T(n3_/n2_)/sqrt(pow(rb-rp,2)+pow(dp,2)) )
-                - ( (ra-rb)*(T(2)*ra-T(2)*rb)/(T(2)*pow(pow(ra-rb,2)+pow(db,2),1.5)) )
-                - ( T(n3_/n2_)*(rb-rp)*(T(2)*rb-T(2)*rp)/(T(2)*pow(pow(rb-rp,2)+pow(dp,2),1.5)) );
-
-            ra = ra - ( (f*dgdrb - g*dfdrb)/(dfdra*dgdrb - dfdrb*dgdra) );
-            rb = rb - ( (g*dfdra - f*dgdra)/(dfdra*dgdrb - dfdrb*dgdra) );
-
-        }
-
-        a[0] = ra*cos(phi) + c[0];
-        a[1] = ra*sin(phi) + c[1];
+        // Refract at the wall and any layers behind it
+        T a[3];
+        refrac_wall_point(c, point, z0_, t_, n1_, n2_, n3_, layers_, a);
 
         // Continuing projecting point a to camera
         T p[3];
@@ -707,6 +682,8 @@ class refractiveReprojectionError {
 
     double observed_x, observed_y, cx, cy, t_, n1_, n2_, n3_, z0_;
     int num_cams;
+    // Index and thickness of each layer behind the wall
+    vector<double> layers_;
 
 };
 
@@ -715,8 +692,8 @@ class refractiveReprojError {
 
  public:
 
- refractiveReprojError(double observed_x, double observed_y, double cx, double cy, int num_cams, double t, double n1, double n2, double n3, double z0, int gridx, int gridy, double grid_phys, int index, int plane_id)
-     : observed_x(observed_x), observed_y(observed_y), cx(cx), cy(cy), num_cams(num_cams), t_(t), n1_(n1), n2_(n2), n3_(n3), z0_(z0), gridx_(gridx), gridy_(gridy), grid_phys_(grid_phys), index_(index), plane_id_(plane_id) { }
+ refractiveReprojError(double observed_x, double observed_y, double cx, double cy, int num_cams, double t, double n1, double n2, double n3, double z0, int gridx, int gridy, double grid_phys, int index, int plane_id, vector<double> layers = vector<double>())
+     : observed_x(observed_x), observed_y(observed_y), cx(cx), cy(cy), num_cams(num_cams), t_(t), n1_(n1), n2_(n2), n3_(n3), z0_(z0), gridx_(gridx), gridy_(gridy), grid_phys_(grid_phys), index_(index), plane_id_(plane_id), layers_(layers) { }
 
     template <typename T>
         bool operator()(const T* const camera,
@@ -751,55 +728,8 @@ class refractiveReprojError {
         point[0] += plane[3]; point[1] += plane[4]; point[2] += plane[5];
 
         // Solve for refraction to reproject point into camera
-        T* a = new T[3];
-        T* b = new T[3];
-        a[0] = c[0] + (point[0]-c[0])*(T(-t_)+T(z0_)-c[2])/(point[2]-c[2]);
-        a[1] = c[1] + (point[1]-c[1])*(T(-t_)+T(z0_)-c[2])/(point[2]-c[2]);
-        a[2] = T(-t_)+T(z0_);
-        b[0] = c[0] + (point[0]-c[0])*(T(z0_)-c[2])/(point[2]-c[2]);
-        b[1] = c[1] + (point[1]-c[1])*(T(z0_)-c[2])/(point[2]-c[2]);
-        b[2] = T(z0_);
-
-        T rp = sqrt( pow(point[0]-c[0],2) + pow(point[1]-c[1],2) );
-        T dp = point[2]-b[2];
-        T phi = atan2(point[1]-c[1],point[0]-c[0]);
-
-        T ra = sqrt( pow(a[0]-c[0],2) + pow(a[1]-c[1],2) );
-        T rb = sqrt( pow(b[0]-c[0],2) + pow(b[1]-c[1],2) );
-        T da = a[2]-c[2];
-        T db = b[2]-a[2];
-
-        T f, g, dfdra, dfdrb, dgdra, dgdrb;
-
-        // Newton Raphson loop to solve for Snell's law
-        for (int iter=0; iter<20; iter++) {
-
-            f = ( ra/sqrt(pow(ra,2)+pow(da,2)) ) - ( T(n2_/n1_)*(rb-ra)/sqrt(pow(rb-ra,2)+pow(db,2)) );
-            g = ( (rb-ra)/sqrt(pow(rb-ra,2)+pow(db,2)) ) - ( T(n3_/n2_)*(rp-rb)/sqrt(pow(rp-rb,2)+pow(dp,2)) );
-
-            dfdra = ( T(1.0)/sqrt(pow(ra,2)+pow(da,2)) )
-                - ( pow(ra,2)/pow(pow(ra,2)+pow(da,2),1.5) )
-                + ( T(n2_/n1_)/sqrt(pow(ra-rb,2)+pow(db,2)) )
-                - ( T(n2_/n1_)*(ra-rb)*(T(2)*ra-T(2)*rb)/(T(2)*pow(pow(ra-rb,2)+pow(db,2),1.5)) );
-
-            dfdrb = ( T(n2_/n1_)*(ra-rb)*(T(2)*ra-T(2)*rb)/(T(2)*pow(pow(ra-rb,2)+pow(db,2),1.5)) )
-                - ( T(n2_/n1_)/sqrt(pow(ra-rb,2)+pow(db,2)) );
-
-            dgdra = ( (ra-rb)*(T(2)*ra-T(2)*rb)/(T(2)*pow(pow(ra-rb,2)+pow(db,2),1.5)) )
-                - ( T(1.0)/sqrt(pow(ra-rb,2)+pow(db,2)) );
-
-            dgdrb = ( T(1.0)/sqrt(pow(ra-rb,2)+pow(db,2)) )
-                + ( T(n3_/n2_)/sqrt(pow(rb-rp,2)+pow(dp,2)) )
-                - ( (ra-rb)*(T(2)*ra-T(2)*rb)/(T(2)*pow(pow(ra-rb,2)+pow(db,2),1.5)) )
-                - ( T(n3_/n2_)*(rb-rp)*(T(2)*rb-T(2)*rp)/(T(2)*pow(pow(rb-rp,2)+pow(dp,2),1.5)) );
-
-            ra = ra - ( (f*dgdrb - g*dfdrb)/(dfdra*dgdrb - dfdrb*dgdra) );
-            rb = rb - ( (g*dfdra - f*dgdra)/(dfdra*dgdrb - dfdrb*dgdra) );
-
-                }
-
-        a[0] = ra*cos(phi) + c[0];
-        a[1] = ra*sin(phi) + c[1];
+        T a[3];
+        refrac_wall_point(c, point, z0_, t_, n1_, n2_, n3_, layers_, a);
 
         // Continuing projecting point a to camera
         T p[3];
@@ -835,6 +765,8 @@ class refractiveReprojError {
 
     double observed_x, observed_y, cx, cy, t_, n1_, n2_, n3_, z0_, grid_phys_;
     int num_cams, gridx_, gridy_, index_, plane_id_;
+    // Index and thickness of each layer behind the wall
+    vector<double> layers_;
 
 };
 
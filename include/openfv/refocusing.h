@@ -48,9 +48,145 @@
 
 #include <yaml-cpp/yaml.h>
 
+#include <map>
+#include <set>
+
 using namespace std;
 using namespace cv;
 
+class frameCache;
+class runningStats;
+class scratchArena;
+template<typename T> class boundedQueue;
+
+//! A stack of refocused images and the directory it is to be written to
+struct stack_job {
+    string path;
+    vector<Mat> stack;
+};
+
+/*!
+  Bounded cache of refractive refocusing remap maps keyed by camera and depth.
+  Maps are held in memory in least recently used order up to a byte limit and
+  can optionally be persisted to a directory so that later runs with the same
+  calibration do not need to solve for refraction again.
+*/
+class refocusMapCache {
+
+ public:
+    ~refocusMapCache() {}
+
+    refocusMapCache();
+
+    /*! Set the maximum memory the cache may hold
+      \param mb Capacity in megabytes (1024 by default). 0 disables in memory
+      caching.
+    */
+    void setCapacity(double mb);
+    /*! Set a directory in which maps are persisted. An empty string disables
+      persistence.
+    */
+    void setPath(string path);
+    /*! Store maps in the fixed point format used internally by remap
+      (CV_16SC2 + CV_16UC1, 6 bytes per pixel) instead of two CV_32FC1 maps
+      (8 bytes per pixel). Refocused images are identical either way.
+    */
+    void setCompact(int flag);
+    /*! Set a string that uniquely describes the geometry the maps are
+      calculated for. Changing it drops all maps held in memory and maps on
+      disk with a different tag are never loaded.
+    */
+    void setTag(string tag);
+
+    //! Look up maps for a camera and depth. Returns false on a miss.
+    bool get(int cam, double z, Mat &map1, Mat &map2);
+    /*! Insert CV_32FC1 maps for a camera and depth. map1 and map2 are replaced
+      by the stored representation so they can be passed to remap directly.
+      Set allow_compact to 0 to always keep floats (e.g. for maps that will be
+      interpolated).
+    */
+    void put(int cam, double z, Mat &map1, Mat &map2, int allow_compact = 1);
+    //! Drop all maps held in memory
+    void clear();
+
+    size_t bytes() { return used_; }
+    int hits() { return hits_; }
+    int misses() { return misses_; }
+
+ private:
+
+    typedef pair<int, long long> map_key;
+
+    struct map_entry {
+        Mat map1, map2;
+        size_t bytes;
+        long long last_used;
+    };
+
+    map_key make_key(int cam, double z);
+    string file_name(map_key key, int compact);
+    bool load(map_key key, Mat &map1, Mat &map2);
+    void save(map_key key, Mat &map1, Mat &map2);
+    void insert(map_key key, Mat &map1, Mat &map2);
+    void evict(size_t bytes);
+
+    std::map<map_key, map_entry> entries_;
+    size_t capacity_;
+    size_t used_;
+    long long clock_;
+    int hits_, misses_;
+    int compact_;
+    string path_;
+    string tag_;
+
+};
+
+/*! Tabulated solution of refract_points for one camera and wall geometry.
+  The crossing point on the wall is stored relative to the straight line from
+  the camera to the point as a function of the slope of that line and of the
+  ratio of the camera to wall distance to the camera to point depth, which
+  keeps the table compact for all depths behind the wall. Values are
+  interpolated bicubically and points outside the table are solved exactly.
+*/
+class refractionLUT {
+
+ public:
+    ~refractionLUT() {}
+
+    refractionLUT(): ns_(-1), nw_(0), err_(0) {}
+
+    /*! Build the table
+      \param c Camera center
+      \param geom Wall geometry as for refract_points
+      \param s_max Largest slope (radial distance over depth from the camera)
+      of the straight line from the camera to a point that is tabulated
+      \param tol Maximum error of the crossing points on the wall
+    */
+    void build(const double c[3], const double geom[5], double s_max, double tol);
+    //! Same as refract_points for the camera and geometry of the table
+    void refract(const double* x, const double* y, const double* z, double* ax, double* ay, int n) const;
+
+    //! True if nothing is tabulated and all points are solved exactly
+    bool empty() const { return ns_ <= 0; }
+    //! Check if the table was built for a camera center and wall geometry
+    bool matches(const double c[3], const double geom[5]) const;
+    //! Largest interpolation error found while building the table
+    double error() const { return err_; }
+    size_t bytes() const { return h_.size()*sizeof(double); }
+
+ private:
+
+    double eval(double s, double w) const;
+    void exact(const vector<double> &s, const vector<double> &w, vector<double> &h) const;
+
+    double c_[3], geom_[5];
+    double s_max_, w_min_, w_max_, ds_, dw_;
+    int ns_, nw_;
+    double err_;
+    vector<double> h_;
+
+};
+
 /*!
   Class with functions that allow user to calculate synthetic aperture refocused
   images using calibration data.
@@ -85,7 +221,7 @@ class saRefocus {
     int num_cams() { return num_cams_; }
     double scale() { return scale_; }
     Size img_size() { return img_size_; }
-    int num_frames() { return imgs[0].size(); }
+    int num_frames();
 
     void set_init_z(double z) { z_ = z; }
     void set_drx(double drx) { drx_ = drx; }
@@ -125,6 +261,90 @@ class saRefocus {
       \return Refocused image as OpenCV Mat type
     */
     Mat refocus(double z, double rx, double ry, double rz, double thresh, int frame);
+    // DocString: refocus_into
+    /*! Calculate a refocused image like refocus() but write it into a buffer
+      provided by the caller, such as a plane from get_planes(), instead of a
+      new image. On the CPU the image is refocused directly into the buffer.
+      \param z Depth in physical units at which to calculate refocused image
+      \param rx Angle by which to rotate focal plane about x axis
+      \param ry Angle by which you rotate focal plane about y axis
+      \param rz Angle by which to rotate focal plane about z axis
+      \param thresh Thresholding level (if additive refocusing is used)
+      \param frame The frame (int time) to refocus. Indexing starts at 0.
+      \param out CV_32F image of size refocused_size() to write into
+    */
+    void refocus_into(double z, double rx, double ry, double rz, double thresh, int frame, Mat out);
+
+    // DocString: refocus_volume
+    /*! Calculate refocused images at all depths between zmin and zmax in one call.
+      All planes are written into a single contiguous buffer and, on the CPU, are
+      refocused in parallel.
+      \param zmin Depth of first plane in physical units
+      \param zmax Depth of last plane in physical units
+      \param dz Spacing between successive planes
+      \param thresh Thresholding level (if additive refocusing is used)
+      \param frame The frame (int time) to refocus. Indexing starts at 0.
+      \return Volume as an OpenCV Mat with all planes stacked along the rows
+      i.e. of size (number of planes * image height) x image width. Use get_planes()
+      to get the individual planes without copying.
+    */
+    Mat refocus_volume(double zmin, double zmax, double dz, double thresh, int frame);
+    // DocString: refocus_planes
+    /*! Calculate refocused images on a batch of planes of any orientation in one
+      call. The homographies of all planes are built together, so oblique slices
+      cost the same as planes of a depth sweep. Only supported by the CPU
+      homography engine (pinhole or HF refractive refocusing).
+      \param planes Matrix with one row (nx, ny, nz, d) per plane, describing the
+      plane n.X = d in physical units. Each output pixel shows the point of the
+      plane above its x and y position, so nz cannot be 0.
+      \param thresh Thresholding level (if additive refocusing is used)
+      \param frame The frame (int time) to refocus. Indexing starts at 0.
+      \return Volume with all planes stacked along the rows like refocus_volume()
+    */
+    Mat refocus_planes(Mat planes, double thresh, int frame);
+    //! Split a volume returned by refocus_volume() into planes that share its data
+    vector<Mat> get_planes(Mat volume);
+
+    // DocString: setROI
+    /*! Only refocus a rectangular region of interest of the refocused image.
+      Refocused images, volumes and stacks are then of the size of the region.
+      \param x Column of top left corner of region in pixels
+      \param y Row of top left corner of region in pixels
+      \param width Width of region in pixels
+      \param height Height of region in pixels
+    */
+    void setROI(int x, int y, int width, int height);
+    // DocString: setROIPhysical
+    /*! Only refocus the region of interest bounded by physical coordinates (in
+      the same units as the calibration) on the focal plane. See setROI().
+    */
+    void setROIPhysical(double xmin, double xmax, double ymin, double ymax);
+    // DocString: clearROI
+    //! Refocus full images again after setROI() or setROIPhysical()
+    void clearROI();
+    //! Region of interest in pixels (the full image if none is set)
+    Rect roi();
+    //! Size of refocused images (size of region of interest if one is set, reduced to the current pyramid level)
+    Size refocused_size();
+
+    // DocString: setPyramidLevels
+    /*! Build an image pyramid of the given number of levels (each half the size
+      of the previous one) from all images so that refocusing can run at lower
+      resolution, for example to scan depths coarsely before refining. Frames
+      that are loaded lazily are reduced when they are used instead.
+      \param levels Number of levels below full resolution
+    */
+    void setPyramidLevels(int levels);
+    // DocString: setPyramidLevel
+    /*! Refocus at a level of the image pyramid. Refocused images at level l are
+      2^l times smaller in each direction and pixel x of them corresponds to
+      pixel 2^l*x at full resolution. Only supported by the CPU homography
+      refocusing engine.
+      \param level Pyramid level (0 for full resolution)
+    */
+    void setPyramidLevel(int level);
+    int pyramid_level() { return level_; }
+    int pyramid_levels() { return pyramid_levels_; }
 
 #ifndef WITHOUT_CUDA
     // DocString: GPUliveView
@@ -179,6 +399,47 @@ class saRefocus {
     void setGpuMode(int flag);
     void setSingleCamDebug(int);
     void setStdevThresh(int);
+    void setTileRows(int rows);
+    void setMapCacheSize(double mb);
+    void setMapCachePath(string path);
+    void setMapCacheCompact(int flag);
+    /*! Calculate exact refractive maps only on a lattice of depths spaced dz
+      apart and cubically interpolate maps at depths in between. The lattice is
+      refined where needed so that the interpolation error stays below tol
+      pixels. Use dz = 0 (default) to calculate exact maps at every depth.
+    */
+    void setRefMapInterp(double dz, double tol);
+    /*! Only refocus regions of the output that every camera sees a non zero
+      pixel in and set the rest to zero. Only used with multiplicative or
+      minimum line of sight refocusing on the CPU.
+    */
+    void setSparse(int flag);
+    /*! Threshold all planes of a refocused volume relative to the mean and
+      standard deviation of the whole volume instead of those of each plane.
+      Only used with standard deviation thresholds on the CPU.
+    */
+    void setVolumeThresh(int flag);
+    /*! Average each pixel over the cameras whose footprint covers it instead
+      of over all cameras so that regions seen by only some cameras are not
+      darkened. Only used with additive refocusing and NLCA on the CPU.
+    */
+    void setOverlapNorm(int flag);
+    /*! Refocus small depth changes (for example in the live view) by shifting
+      warped images of each camera cached at an earlier depth instead of warping
+      all images again. Images are warped again whenever a shift would differ
+      from the exact warp by more than tol pixels anywhere. Only used with
+      pinhole refocusing on the CPU.
+      \param tol Maximum approximation error in pixels (0 to turn off)
+    */
+    void setIncrementalTol(double tol);
+    /*! Replace the iterative refraction solver of each camera by a table of
+      its solutions that is interpolated bicubically. The table is built when
+      calibration data or the wall geometry is set (or on first use) and is
+      refined until the crossing points on the wall are within tol of the exact
+      solution. Only used by refractive refocusing on the CPU.
+      \param tol Maximum error in calibration units (0 to solve exactly)
+    */
+    void setRefractionLUT(double tol);
     void setArrayData(vector<Mat> imgs, vector<Mat> Pmats, vector<Mat> cam_locations);
     void updateHinv();
     void addView(Mat img, Mat P, Mat location);
@@ -191,7 +452,15 @@ class saRefocus {
     void setNlcaWindow(int size);
     void setHF(int hf);
     void setRefractive(int ref, double zW, double n1, double n2, double n3, double t);
-    void setWeightingMode(int mode) { weighting_mode_ = mode; }
+    /*! Add layers between the wall and the scene, such as a second window and
+      an index matched layer, to the refractive geometry. The scene side index
+      n3 then applies behind the last layer. At most REFRAC_MAX_LAYERS layers
+      including the wall are supported.
+      \param layers Refractive index and thickness of each layer after the wall
+      towards the scene, in pairs (empty for the wall alone)
+    */
+    void setRefractiveLayers(vector<double> layers);
+    void setWeightingMode(int mode) { weighting_mode_ = mode; views_generation_++; }
     string showSettings();
 
     Mat project_point(int cam, Mat_<double> X);
@@ -205,11 +474,40 @@ class saRefocus {
 
  private:
 
+    Mat get_view(int cam, int frame);
+    void decode_frames(boundedQueue<int> *queue);
     void calc_ref_refocus_map(Mat_<double> Xcam, double z, Mat_<double> &x, Mat_<double> &y, int cam);
     void calc_refocus_map(Mat_<double> &x, Mat_<double> &y, int cam);
+    void calc_ref_refocus_pts(Mat_<double> Xcam, double z, Mat_<double> X, Mat_<double> &proj, int cam, int cols = 0);
+    void get_ref_refocus_map(int cam, double z, Mat &map1, Mat &map2);
+    void get_ref_lattice_map(int cam, double z, Mat &xmap, Mat &ymap);
+    void interp_ref_refocus_map(int cam, double z, Mat &map1, Mat &map2);
+    double ref_lattice_error(int cam, long long k, double h);
+    scratchArena& scratch();
+    string ref_map_tag();
     void calc_ref_refocus_H(int cam, Mat &H);
+    void calc_ref_plane_H(int cam, const Mat_<double> &plane, Mat &H);
+    void calc_plane_Hs_inv(const Mat_<double> &poses, vector< vector<Mat> > &Ms);
+    void scale_to_level(vector<Mat> &Ms);
+    void build_pyramids(int first_cam = 0);
     void calc_refocus_H(int cam, Mat &H);
+    void build_homography_sweep();
+    void calc_refocus_H_inv(int cam, double z, Mat &H_inv);
+    void calc_inverse_Hs(vector<Mat> &Ms);
+    void CPUrefocus_tiles(vector< vector<Mat> > &Ms, int frame, vector<Mat> &planes, int thresholding);
+    void CPUnlca(vector<Mat> &planes);
+    void CPUrefocus_incremental(int frame, Mat out);
+    Mat cpu_output_buffer();
+    void set_result(const Mat &img);
+    void stdev_threshold(vector<Mat> &planes, const vector<runningStats> &stats, int tiles_per_plane);
     void img_refrac(Mat_<double> Xcam, Mat_<double> X, Mat_<double> &X_out);
+    // cols > 0 means X holds a grid of points with cols points per row
+    void img_refrac(int cam, Mat_<double> X, Mat_<double> &X_out, int cols = 0);
+    void build_ref_luts();
+    void build_ref_lut(int cam);
+    // Fills g with REFRAC_GEOM_SIZE(layers) entries describing the wall and any
+    // further layers and returns the number of layers
+    int ref_geom(double* g);
 
     void threshold_image(Mat &refocused);
     void apply_preprocess(void (*preprocess_func)(Mat, Mat), string path);
@@ -227,6 +525,8 @@ class saRefocus {
 
     // Refocusing result
     Mat result_;
+    // Caller's buffer during refocus_into()
+    Mat out_buf_;
 
     // data types and private functions
     vector<Mat> P_mats_;
@@ -249,8 +549,24 @@ class saRefocus {
     vector< vector<Mat> > cam_stacks_;
     Mat D_, hinv_;
 
+    // Frames decoded on demand when lazy loading is ON (shared between copies)
+    boost::shared_ptr<frameCache> frame_cache_;
+    double frame_cache_size_;
+    int prefetch_frames_;
+
+    // Region of interest in pixels (empty to refocus full images)
+    Rect roi_;
+
+    // Homography sweep table (pinhole): destination to source homography of
+    // camera i at depth z is hsweep_base_[i] + z*hsweep_slope_[i]
+    vector<Mat> hsweep_base_, hsweep_slope_;
+    double hsweep_pose_[5];
+    int hsweep_valid_;
+
     // Scene geometry params
     float geom[5];
+    // Index and thickness of each layer behind the wall towards the scene
+    vector<double> ref_layers_;
 
     // Refocusing parameters
     double z_, dz_, zs_, xs_, ys_, dx_, dy_, rx_, ry_, rz_, drx_, dry_, drz_, cxs_, cys_, czs_, crx_, cry_, crz_;
@@ -277,10 +593,28 @@ class saRefocus {
 
     Mat cputemp; Mat cputemp2; Mat cpurefocused;
 
+    // Number of output rows in each tile processed by the CPU engine
+    int tile_rows_;
+
+    // Refractive remap maps reused across frames and calls
+    refocusMapCache map_cache_;
+
+    // Depth lattice for interpolated refractive maps. Spacing is refined per
+    // camera and lattice intervals known to meet the error bound are recorded.
+    double ref_map_dz_, ref_map_tol_;
+    vector<double> ref_lattice_dz_;
+    vector< set<long long> > ref_lattice_ok_;
+    string ref_lattice_tag_;
+
+    // Temporaries of the refractive remap path, one arena per thread shared by
+    // copies of this object
+    boost::shared_ptr< boost::thread_specific_ptr<scratchArena> > scratch_;
+
 #ifndef WITHOUT_CUDA
     vector<gpu::GpuMat> array, xmaps, ymaps, warped_, warped2_, P_mats_gpu, cam_locations_gpu;
     vector< vector<gpu::GpuMat> > array_all;
     gpu::GpuMat temp, temp2, refocused, xmap, ymap, blank_, blank_int_;
+    vector<refracCam> ref_cams_;
 #endif
 
     int frame_to_upload_;
@@ -296,8 +630,33 @@ class saRefocus {
     // to add a variable to the refocus_settings struct.
     int STDEV_THRESH;
     int SINGLE_CAM_DEBUG;
-    double IMG_REFRAC_TOL;
+    int SPARSE_FLAG;
+    int LAZY_FLAG;
+    int VOLUME_THRESH;
+    int OVERLAP_NORM_FLAG;
+
+    // Reduced images indexed by pyramid level - 1, camera and frame
+    vector< vector< vector<Mat> > > pyr_imgs_;
+    int pyramid_levels_;
+    int level_;
+
+    // Warped images of each camera, their inverse homographies and the pose,
+    // frame, level, views generation and region they were calculated for in
+    // incremental refocusing
+    double incr_tol_;
+    vector<Mat> incr_warps_, incr_Ms_;
+    double incr_key_[8];
+    // Incremented whenever cameras, their images or calibration change
+    int views_generation_;
+    Rect incr_roi_;
+    // Newton iterations of the refraction solver for scattered points, and
+    // accuracy and iteration limit for grids of points that are warm started
+    int NR_ITERS;
+    double NR_TOL;
     int MAX_NR_ITERS;
+    // Tabulated refraction solutions per camera
+    double ref_lut_tol_;
+    vector<refractionLUT> ref_luts_;
     int BENCHMARK_MODE;
     int INT_IMG_MODE;
     int RESIZE_IMAGES;
@@ -0,0 +1,304 @@
+//  IMPORTANT: READ BEFORE DOWNLOADING, COPYING, INSTALLING OR USING.
+//
+//  By downloading, copying, installing or using the software you agree to this license.
+//  If you do not agree to this license, do not download, install,
+//  copy or use the software.
+//
+//                           License Agreement
+//                For Open Source Flow Visualization Library
+//
+// Copyright 2013-2017 Abhishek Bajpayee
+//
+// This file is part of OpenFV.
+//
+// OpenFV is free software: you can redistribute it and/or modify it under the terms of the
+// GNU General Public License version 2 as published by the Free Software Foundation.
+//
+// OpenFV is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+// without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+// See the GNU General Public License version 2 for more details.
+//
+// You should have received a copy of the GNU General Public License version 2 along with
+// OpenFV. If not, see https://www.gnu.org/licenses/old-licenses/gpl-2.0.en.html.
+
+#ifndef REFRACTION_LIBRARY
+#define REFRACTION_LIBRARY
+
+#include <cmath>
+
+// Refraction of rays from a camera through a flat wall normal to the z axis
+// into the scene. Everything is templated on the value type so the same code
+// serves float and double on the CPU and GPU, SIMD lanes of points and ceres
+// cost functions.
+//
+// In the plane containing the camera center and a point, the ray crosses the
+// camera side face of the wall at radial distance ra from the camera axis and
+// the scene side face at rb. With da, db and dp the z distances from the camera
+// to the wall, through the wall and from the wall to the point, Snell's law at
+// the two faces reads
+//
+//   f = ra/|(ra, da)| - k1 (rb-ra)/|(rb-ra, db)| = 0,   k1 = n2/n1
+//   g = (rb-ra)/|(rb-ra, db)| - k2 (rp-rb)/|(rp-rb, dp)| = 0,   k2 = n3/n2
+//
+// which is solved for ra and rb by Newton's method.
+
+#ifdef __CUDACC__
+#define REFRAC_HD __host__ __device__
+#else
+#define REFRAC_HD
+#endif
+
+//! Square root used by the solver. Other types (SIMD lanes, ceres::Jet) are
+//! found by argument dependent lookup.
+REFRAC_HD inline float refrac_sqrt(float x) { return sqrtf(x); }
+REFRAC_HD inline double refrac_sqrt(double x) { return sqrt(x); }
+template<typename T>
+inline T refrac_sqrt(const T &x) { using std::sqrt; return sqrt(x); }
+
+/*! Straight line from the camera to a point as the initial guess of the solver
+  \param rp Radial distance of the point from the camera
+  \param dz z distance of the point from the camera
+  \param da z distance from the camera to the camera side face of the wall
+  \param db Wall thickness
+  \param ra Radial distance of the crossing of the camera side face (output)
+  \param rb Radial distance of the crossing of the scene side face (output)
+*/
+template<typename T>
+REFRAC_HD inline void refrac_initial_guess(const T &rp, const T &dz, const T &da, const T &db, T &ra, T &rb) {
+
+    T s = rp/dz;
+    ra = s*da;
+    rb = s*(da + db);
+
+}
+
+/*! One Newton iteration with the simplified analytic Jacobian
+    df/dra = da^2/|(ra, da)|^3 + k1 db^2/|(rb-ra, db)|^3
+    df/drb = -k1 db^2/|(rb-ra, db)|^3
+    dg/dra = -db^2/|(rb-ra, db)|^3
+    dg/drb = db^2/|(rb-ra, db)|^3 + k2 dp^2/|(rp-rb, dp)|^3
+  \param da2 da squared
+  \param db2 db squared
+  \param dp2 dp squared
+  \param f Residual f before the update (output)
+  \param g Residual g before the update (output)
+*/
+template<typename T>
+REFRAC_HD inline void refrac_newton_step(const T &rp, const T &da2, const T &db2, const T &dp2, const T &k1, const T &k2, T &ra, T &rb, T &f, T &g) {
+
+    T one(1);
+    T u = rb - ra, w = rp - rb;
+    T ia = one/refrac_sqrt(ra*ra + da2);
+    T iab = one/refrac_sqrt(u*u + db2);
+    T ibp = one/refrac_sqrt(w*w + dp2);
+    f = ra*ia - k1*u*iab;
+    g = u*iab - k2*w*ibp;
+
+    T A = da2*ia*ia*ia, B = db2*iab*iab*iab, C = dp2*ibp*ibp*ibp;
+    T dfdra = A + k1*B, dgdrb = B + k2*C, k1B = k1*B;
+    T idet = one/(dfdra*dgdrb - k1B*B);
+    ra = ra - (f*dgdrb + g*k1B)*idet;
+    rb = rb - (g*dfdra + f*B)*idet;
+
+}
+
+/*! Solve for ra and rb with a fixed number of Newton iterations starting from
+  the values passed in, which can be refrac_initial_guess() or the solution
+  for a nearby point
+  \param dp z distance from the scene side face of the wall to the point
+  \param k1 n2/n1
+  \param k2 n3/n2
+  \param f Residual f before the last iteration (output)
+  \param g Residual g before the last iteration (output)
+*/
+template<typename T>
+REFRAC_HD inline void refrac_solve(const T &rp, const T &da, const T &db, const T &dp, const T &k1, const T &k2, T &ra, T &rb, int iters, T &f, T &g) {
+
+    T da2 = da*da, db2 = db*db, dp2 = dp*dp;
+    for (int i=0; i<iters; i++)
+        refrac_newton_step(rp, da2, db2, dp2, k1, k2, ra, rb, f, g);
+
+}
+
+/*! Find where the ray from camera center c to point p crosses the camera side
+  face of the wall
+  \param c Camera center
+  \param p Point
+  \param zW z coordinate of the camera side face of the wall
+  \param t Wall thickness
+  \param n1 Refractive index on the camera side
+  \param n2 Refractive index of the wall
+  \param n3 Refractive index on the scene side
+  \param a Crossing point (output)
+  \param iters Number of Newton iterations
+*/
+template<typename T>
+REFRAC_HD inline void refrac_point(const T c[3], const T p[3], const T &zW, const T &t, const T &n1, const T &n2, const T &n3, T a[3], int iters) {
+
+    T dx = p[0] - c[0], dy = p[1] - c[1], dz = p[2] - c[2];
+    T rp = refrac_sqrt(dx*dx + dy*dy);
+    T da = zW - c[2];
+
+    T ra, rb, f, g;
+    refrac_initial_guess(rp, dz, da, t, ra, rb);
+    refrac_solve(rp, da, t, dz - da - t, n2/n1, n3/n2, ra, rb, iters, f, g);
+
+    // Scale along the radial direction instead of using atan2, cos and sin
+    if (rp > T(0)) {
+        T r = ra/rp;
+        a[0] = c[0] + dx*r;
+        a[1] = c[1] + dy*r;
+    } else {
+        a[0] = c[0];
+        a[1] = c[1];
+    }
+    a[2] = zW;
+
+}
+
+// Stacks of several planar layers, such as a tank with two windows and an
+// index matched layer between them, are described by a geometry array of
+// REFRAC_GEOM_SIZE(layers) entries
+//
+//   zW, n1, n2, n3, t, n_2, t_2, ..., n_N, t_N
+//
+// which for one layer is the wall above. zW is the camera side face of the
+// first layer, n1 and n3 are the indices on the camera and scene sides, n2 and
+// t describe the first layer and the pairs after them the following layers
+// towards the scene.
+//
+// Snell's law keeps n sin(theta) equal in all media, so the whole ray is fixed
+// by its slope s in the medium of lowest index n_m. With rho_i = n_m/n_i the
+// slope in medium i is rho_i s/sqrt(1 + (1 - rho_i^2) s^2) and the ray has to
+// reach the point, which leaves one equation
+//
+//   F(s) = sum_i d_i rho_i s/sqrt(1 + (1 - rho_i^2) s^2) - rp = 0
+//
+// for the z distances d_i travelled in each medium. F is increasing and
+// concave, and the paraxial guess s = rp/sum_i d_i rho_i has F <= 0, so Newton
+// iterations approach the root from below without any safeguards.
+
+//! Largest number of layers supported by refrac_layers_setup()
+#define REFRAC_MAX_LAYERS 4
+
+//! Number of entries of the geometry array of a stack of layers
+#define REFRAC_GEOM_SIZE(layers) (3 + 2*(layers))
+
+//! Stack of layers prepared by refrac_layers_setup() for the solver
+template<typename T>
+struct refracLayers {
+
+    int media;                      //!< Number of media (layers + 2)
+    T rho[REFRAC_MAX_LAYERS+2];     //!< n_m/n_i of each medium from the camera side
+    T e[REFRAC_MAX_LAYERS+2];       //!< 1 - rho^2 of each medium
+    T t[REFRAC_MAX_LAYERS+2];       //!< Thickness of each layer (first and last unused)
+    T depth;                        //!< Total thickness of the layers
+
+};
+
+/*! Prepare a stack of layers for the solver
+  \param geom Geometry array as described above
+  \param layers Number of layers, at most REFRAC_MAX_LAYERS
+  \param L Prepared stack (output)
+*/
+template<typename T, typename G>
+REFRAC_HD inline void refrac_layers_setup(const G *geom, int layers, refracLayers<T> &L) {
+
+    G n[REFRAC_MAX_LAYERS+2], t[REFRAC_MAX_LAYERS+2];
+    n[0] = geom[1]; n[1] = geom[2]; t[1] = geom[4];
+    for (int k=2; k<=layers; k++) {
+        n[k] = geom[2*k+1];
+        t[k] = geom[2*k+2];
+    }
+    n[layers+1] = geom[3];
+
+    G nm = n[0];
+    for (int i=1; i<layers+2; i++)
+        if (n[i] < nm) nm = n[i];
+
+    L.media = layers + 2;
+    G depth = 0;
+    for (int i=0; i<layers+2; i++) {
+        G rho = nm/n[i];
+        L.rho[i] = T(rho);
+        L.e[i] = T(1 - rho*rho);
+        L.t[i] = T(0);
+    }
+    for (int k=1; k<=layers; k++) {
+        L.t[k] = T(t[k]);
+        depth += t[k];
+    }
+    L.depth = T(depth);
+
+}
+
+/*! Add the contribution of one medium to F and dF/ds
+  \param d z distance travelled in the medium
+*/
+template<typename T>
+REFRAC_HD inline void refrac_layers_term(const T &d, const T &rho, const T &e, const T &s, T &F, T &dF) {
+
+    T q = T(1)/refrac_sqrt(T(1) + e*s*s);
+    T u = d*rho*q;
+    F = F + u*s;
+    dF = dF + u*q*q;
+
+}
+
+/*! Solve for the radial distance from the camera axis at which the ray to a
+  point crosses the camera side face of a stack of layers with a fixed number
+  of Newton iterations
+  \param L Stack of layers
+  \param rp Radial distance of the point from the camera
+  \param da z distance from the camera to the camera side face of the stack
+  \param dp z distance from the scene side face of the stack to the point
+  \param iters Number of Newton iterations
+*/
+template<typename T>
+REFRAC_HD inline T refrac_layers_solve(const refracLayers<T> &L, const T &rp, const T &da, const T &dp, int iters) {
+
+    int m = L.media - 1;
+    T sum = da*L.rho[0] + dp*L.rho[m];
+    for (int k=1; k<m; k++)
+        sum = sum + L.t[k]*L.rho[k];
+    T s = rp/sum;
+
+    for (int i=0; i<iters; i++) {
+        T F = T(0), dF = T(0);
+        refrac_layers_term(da, L.rho[0], L.e[0], s, F, dF);
+        for (int k=1; k<m; k++)
+            refrac_layers_term(L.t[k], L.rho[k], L.e[k], s, F, dF);
+        refrac_layers_term(dp, L.rho[m], L.e[m], s, F, dF);
+        s = s - (F - rp)/dF;
+    }
+
+    return da*L.rho[0]*s/refrac_sqrt(T(1) + L.e[0]*s*s);
+
+}
+
+/*! Same as refrac_point for a stack of layers
+  \param zW z coordinate of the camera side face of the stack
+  \param L Stack of layers
+*/
+template<typename T>
+REFRAC_HD inline void refrac_layers_point(const T c[3], const T p[3], const T &zW, const refracLayers<T> &L, T a[3], int iters) {
+
+    T dx = p[0] - c[0], dy = p[1] - c[1], dz = p[2] - c[2];
+    T rp = refrac_sqrt(dx*dx + dy*dy);
+    T da = zW - c[2];
+
+    T ra = refrac_layers_solve(L, rp, da, dz - da - L.depth, iters);
+
+    if (rp > T(0)) {
+        T r = ra/rp;
+        a[0] = c[0] + dx*r;
+        a[1] = c[1] + dy*r;
+    } else {
+        a[0] = c[0];
+        a[1] = c[1];
+    }
+    a[2] = zW;
+
+}
+
+#endif
@@ -94,6 +94,12 @@ class Scene {
       \param t Thickness of glass wall
     */
     void setRefractiveGeom(float zW, float n1, float n2, float n3, float t);
+    /*! Add layers between the glass wall and the water, such as a second
+      window, to the refractive geometry. n3 then applies behind the last layer.
+      \param layers Refractive index and thickness of each layer after the wall
+      towards the scene, in pairs
+    */
+    void setRefractiveLayers(vector<float> layers);
     void setActiveFrame(int frame);
     int getActiveFrame() { return frame_; }
 
@@ -61,6 +61,9 @@ namespace libtiff {
 #endif
 
 #include <boost/chrono.hpp>
+#include <boost/thread.hpp>
+#include <boost/bind.hpp>
+#include <boost/shared_ptr.hpp>
 
 // Python library
 #include <Python.h>
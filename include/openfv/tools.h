@@ -29,6 +29,8 @@
 #include "refocusing.h"
 #include "rendering.h"
 
+#include <deque>
+
 using namespace std;
 using namespace cv;
 using namespace libtiff;
@@ -237,6 +239,332 @@ private:
 
 };
 
+/*! Converts an image to CV_32F ranging between 0 and 1 assuming black and
+  white pixel values depend on the datatype
+  \param img Image to convert (in place)
+  \param keep_8bit Keep CV_8U images as is
+  \param keep_16bit Keep CV_16U images as is
+  \param verbose Log the conversion that is applied
+*/
+void convert_frame(Mat &img, int keep_8bit, int keep_16bit, bool verbose = false);
+
+/*! Applies additive refocusing weighting to an image, i.e. pixels below the
+  mean intensity are made negative
+  \param img Image to weight (in place)
+  \param mode Weighting mode (1 or 2)
+  \param num_cams Number of cameras in the array
+*/
+void weight_frame(Mat &img, int mode, int num_cams);
+
+/*! Finds where rays from a camera to a batch of points cross the camera side
+  face of a flat refractive wall (z = zW) by solving Snell's law at both faces
+  of the wall. Points are given in structure of arrays layout and are solved
+  several at a time in SIMD lanes with a fixed number of Newton iterations.
+  \param c Camera center
+  \param geom Wall geometry: zW, refractive indices n1, n2 and n3 of the
+  camera side medium, the wall and the scene side medium, and wall thickness t
+  \param x x coordinates of points
+  \param y y coordinates of points
+  \param z z coordinates of points
+  \param ax x coordinates of crossing points (output)
+  \param ay y coordinates of crossing points (output)
+  \param n Number of points
+  \param iters Number of Newton iterations. The defaults reach the precision of
+  the type for cameras and scenes on opposite sides of the wall.
+*/
+void refract_points(const double c[3], const double geom[5], const double* x, const double* y, const double* z, double* ax, double* ay, int n, int iters = 4);
+void refract_points(const float c[3], const float geom[5], const float* x, const float* y, const float* z, float* ax, float* ay, int n, int iters = 3);
+
+//! Newton iteration counts of refract_grid
+struct refracStats {
+
+    refracStats(): points(0), iters(0), max_iters(0) {}
+
+    //! Record n points that took it iterations
+    void add(int it, int n) { points += n; iters += (long long)it*n; max_iters = max(max_iters, it); }
+    double mean() const { return points > 0 ? double(iters)/points : 0; }
+
+    long long points;
+    long long iters;
+    int max_iters;
+
+};
+
+/*! Same as refract_points for a grid of points stored row by row, such as the
+  pixels of a refocused image. Points are solved a row at a time with each
+  SIMD lane of points starting from the solutions of the points above it, and
+  iterations stop once the Newton updates of all points in a lane are small
+  enough for the error to be below tol, so most points converge in one
+  iteration.
+  \param rows Number of rows of the grid
+  \param cols Number of columns of the grid
+  \param tol Accuracy of the crossing points
+  \param max_iters Maximum number of Newton iterations
+  \param stats Iteration counts (output, can be NULL)
+*/
+void refract_grid(const double c[3], const double geom[5], const double* x, const double* y, const double* z, double* ax, double* ay, int rows, int cols, double tol, int max_iters, refracStats* stats = NULL);
+
+/*! Same as refract_points for a stack of planar layers, such as a tank with
+  several windows, solved with the single unknown formulation of refraction.h
+  \param geom Geometry of the stack with REFRAC_GEOM_SIZE(layers) entries: zW,
+  n1, n2, n3 and t as for refract_points followed by the index and thickness
+  of each further layer towards the scene
+  \param layers Number of layers, between 1 and REFRAC_MAX_LAYERS
+  \param iters Number of Newton iterations. The default reaches the precision
+  of double for cameras and scenes on opposite sides of the stack.
+*/
+void refract_layers(const double c[3], const double* geom, int layers, const double* x, const double* y, const double* z, double* ax, double* ay, int n, int iters = 3);
+void refract_layers(const float c[3], const float* geom, int layers, const float* x, const float* y, const float* z, float* ax, float* ay, int n, int iters = 3);
+
+//! Cubic Lagrange weights for nodes at -1, 0, 1 and 2 evaluated at t
+void cubic_weights(double t, double w[4]);
+
+/*! Running count, mean and variance of a stream of values (Welford). Partial
+  statistics of separate blocks of data can be merged in any order.
+*/
+class runningStats {
+
+ public:
+    ~runningStats() {}
+
+    runningStats(): n_(0), mean_(0), m2_(0) {}
+
+    //! Add len values
+    void add(const float* values, int len);
+    //! Add count values that are all equal to value
+    void add(double value, double count);
+    //! Merge statistics of another block of values
+    void merge(const runningStats &stats);
+
+    double count() const { return n_; }
+    double mean() const { return mean_; }
+    //! Population variance, like meanStdDev
+    double variance() const { return n_ > 0 ? m2_/n_ : 0; }
+    double stdev() const { return sqrt(variance()); }
+
+ private:
+
+    double n_;
+    double mean_;
+    double m2_;
+
+};
+
+/*! Pool of reusable buffers for temporary matrices. get() hands buffers out
+  in order and reset() recycles all of them, so repeating the same sequence of
+  requests after a reset reuses the same memory without heap allocations.
+  Matrices returned by get() stay valid until the next reset().
+*/
+class scratchArena {
+
+ public:
+    ~scratchArena() {}
+
+    scratchArena(): next_(0) {}
+
+    //! Get a continuous rows x cols matrix of the given type with undefined contents
+    Mat get(int rows, int cols, int type);
+    Mat get(Size size, int type) { return get(size.height, size.width, type); }
+    //! Make all buffers available again
+    void reset() { next_ = 0; }
+
+    //! Number of buffers held and their total size in bytes
+    int buffers() const { return bufs_.size(); }
+    size_t bytes() const;
+
+ private:
+
+    vector<Mat> bufs_;
+    size_t next_;
+
+};
+
+/*! Blocking first in first out queue with a maximum size used to pass work
+  between the threads of a pipeline */
+template<typename T>
+class boundedQueue {
+
+ public:
+    ~boundedQueue() {}
+
+    boundedQueue(int capacity): capacity_(capacity), closed_(false) {}
+
+    //! Add an item, waiting while the queue is full
+    void push(const T &item) {
+        boost::unique_lock<boost::mutex> lock(mutex_);
+        while (queue_.size() >= capacity_)
+            not_full_.wait(lock);
+        queue_.push_back(item);
+        not_empty_.notify_one();
+    }
+
+    /*! Take the oldest item, waiting while the queue is empty
+      \return false if the queue is empty and has been closed
+    */
+    bool pop(T &item) {
+        boost::unique_lock<boost::mutex> lock(mutex_);
+        while (queue_.empty() && !closed_)
+            not_empty_.wait(lock);
+        if (queue_.empty())
+            return false;
+        item = queue_.front();
+        queue_.pop_front();
+        not_full_.notify_one();
+        return true;
+    }
+
+    //! Signal that no more items will be pushed
+    void close() {
+        boost::lock_guard<boost::mutex> lock(mutex_);
+        closed_ = true;
+        not_empty_.notify_all();
+    }
+
+ private:
+
+    std::deque<T> queue_;
+    size_t capacity_;
+    bool closed_;
+    boost::mutex mutex_;
+    boost::condition_variable not_full_, not_empty_;
+
+};
+
+/*! Source of camera images that frames are decoded from on demand */
+class frameSource {
+
+ public:
+    virtual ~frameSource() {}
+
+    //! Decode image of camera cam at frame (index into frames being refocused)
+    virtual Mat get_frame(int cam, int frame) = 0;
+    virtual int num_frames() = 0;
+
+};
+
+/*! Frames stored as individual image files in one folder per camera */
+class imageFolderSource : public frameSource {
+
+ public:
+    ~imageFolderSource() {}
+
+    /*! \param names Image file names indexed by camera and frame
+      \param K_mats Camera matrices used to undistort images
+      \param dist_coeffs Fisheye distortion coefficients used to undistort images
+      \param undistort Flag to undistort images or not
+    */
+    imageFolderSource(vector< vector<string> > names, vector<Mat> K_mats, vector<Mat> dist_coeffs, int undistort);
+
+    Mat get_frame(int cam, int frame);
+    int num_frames() { return names_[0].size(); }
+
+ private:
+
+    vector< vector<string> > names_;
+    vector<Mat> K_mats_;
+    vector<Mat> dist_coeffs_;
+    int undistort_;
+
+};
+
+/*! Frames stored in one multipage TIFF file per camera */
+class mtiffSource : public frameSource {
+
+ public:
+    ~mtiffSource() {}
+
+    /*! \param tiffs Reader for each camera
+      \param frames Pages to read from each file
+    */
+    mtiffSource(vector<mtiffReader> tiffs, vector<int> frames);
+
+    Mat get_frame(int cam, int frame);
+    int num_frames() { return frames_.size(); }
+
+ private:
+
+    vector<mtiffReader> tiffs_;
+    vector<int> frames_;
+    // libtiff handles can not be used from several threads at once
+    boost::mutex mutex_;
+
+};
+
+/*!
+  Bounded least recently used cache of decoded and converted camera frames.
+  Whenever a frame is requested, the next few frames of all cameras are decoded
+  by a background thread so that they are ready when needed.
+*/
+class frameCache {
+
+ public:
+    ~frameCache();
+
+    /*! \param source Source to decode frames from (owned by the cache)
+      \param num_cams Number of cameras
+      \param mb Maximum memory in MB used by cached frames
+      \param prefetch Number of frames following a requested frame to prefetch
+    */
+    frameCache(frameSource* source, int num_cams, double mb, int prefetch);
+
+    /*! Set conversion applied to every decoded frame. See convert_frame()
+      and weight_frame().
+    */
+    void setConversion(int keep_8bit, int keep_16bit, int weighting_mode);
+
+    /*! Get image of camera cam at frame, decoding it if it is not cached
+      \param level Number of times the frame is reduced with pyrDown. Reduced
+      frames are cached alongside the full resolution ones.
+    */
+    Mat get(int cam, int frame, int level = 0);
+    int num_frames() { return source_->num_frames(); }
+
+ private:
+
+    struct frame_key {
+        int cam, frame, level;
+        frame_key(int c, int f, int l = 0): cam(c), frame(f), level(l) {}
+        bool operator<(const frame_key &k) const {
+            if (cam != k.cam) return cam < k.cam;
+            if (frame != k.frame) return frame < k.frame;
+            return level < k.level;
+        }
+        bool operator==(const frame_key &k) const {
+            return cam == k.cam && frame == k.frame && level == k.level;
+        }
+    };
+
+    struct frame_entry {
+        Mat img;
+        long long last_used;
+    };
+
+    // Decodes and converts a frame without holding the mutex, using conversion
+    // settings read under it
+    Mat load(frame_key key, int keep_8bit, int keep_16bit, int weighting_mode);
+    void insert(frame_key key, Mat img);
+    void schedule(int frame);
+    void run();
+
+    boost::shared_ptr<frameSource> source_;
+    int num_cams_;
+    size_t capacity_, used_;
+    int prefetch_;
+    int keep_8bit_, keep_16bit_, weighting_mode_;
+
+    std::map<frame_key, frame_entry> entries_;
+    std::set<frame_key> pending_;
+    std::deque<frame_key> queue_;
+    long long clock_;
+    int generation_;
+
+    boost::mutex mutex_;
+    boost::condition_variable cond_;
+    boost::thread worker_;
+    bool stop_;
+
+};
+
 class mp4Reader {
 
 public:
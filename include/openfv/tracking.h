@@ -76,6 +76,12 @@ class pLocalize {
         \param frame The frame number in which to find the particles.
     */
     void find_particles_3d(int frame);
+    /*! Scan the volume at a reduced resolution pyramid level first and only
+        refocus depths near planes that particles are found in at full
+        resolution. Requires the CPU homography refocusing engine.
+        \param level Pyramid level to scan at (0 to refocus all depths at full resolution)
+    */
+    void setCoarseLevel(int level);
 
     void save_refocus(int frame);
     void z_resolution();
@@ -107,6 +113,7 @@ class pLocalize {
     int point_in_list(Point2f point, vector<Point2f> points);
     double min_dist(Point2f point, vector<Point2f> points);
     double get_zloc(vector<particle2d> cluster);
+    void coarse_depths(int frame, vector<double> &zs);
 
     int window_;
     int cluster_size_;
@@ -115,6 +122,7 @@ class pLocalize {
     double dz_;
     double thresh_;
     double zext_;
+    int coarse_level_;
 
     int zmethod_;
 
@@ -85,6 +85,37 @@ struct refocus_settings {
 
     //! Whether to undistort images or not
     int undistort;
+
+    //! Memory in MB to use for caching refractive refocusing maps
+    double map_cache_size;
+    //! Directory in which refractive refocusing maps are persisted (empty to disable)
+    string map_cache_path;
+    //! Depth spacing of exact refractive maps that others are interpolated from (0 to disable)
+    double ref_map_dz;
+    //! Maximum allowed error (in pixels) of interpolated refractive maps
+    double ref_map_tol;
+    //! Maximum error of tabulated refraction solutions (0 to solve exactly)
+    double ref_lut_tol;
+    //! Index and thickness of each refractive layer behind the calibrated wall, in pairs
+    vector<double> ref_layers;
+    //! Skip regions of the refocused images that are zero (mult and minlos only)
+    int sparse;
+    //! Threshold refocused volumes using statistics of the whole volume instead of each plane
+    int volume_thresh;
+    //! Average pixels over the cameras that see them instead of all cameras
+    int overlap_norm;
+    //! Number of image pyramid levels below full resolution to build for coarse refocusing
+    int pyramid_levels;
+    //! Maximum error in pixels when refocusing small depth changes by shifting cached warped images (0 to disable)
+    double incremental_tol;
+    //! Keep 8 and 16 bit images in their native type instead of converting to float
+    int int_img_mode;
+    //! Read frames when they are needed instead of all at once up front
+    int lazy_loading;
+    //! Memory in MB to use for decoded frames when lazy loading is ON
+    double frame_cache_size;
+    //! Number of upcoming frames to decode in the background when lazy loading is ON
+    int prefetch_frames;
     
 };
 
@@ -0,0 +1,157 @@
+"""
+Checks refractive refocusing with a 25 camera array.
+
+A 5 x 5 array of synthetic cameras looks through a glass wall into water.
+First, saRefocus.project_point is compared against an independent
+refraction solver for all cameras. Then the views are refocused with
+CPUrefocus_ref (or GPUrefocus_ref with --gpu). Each refocused pixel is
+compared against the mean of the views sampled at the per-camera
+project_point of that pixel's world point.
+
+usage: python check_refractive_25.py [--gpu]
+"""
+
+from __future__ import print_function
+
+import sys
+import numpy as np
+import numpy.linalg as la
+import cv2
+
+from openfv import refocusing
+
+# all units in mm
+
+zW = -40.0 # camera side face of the wall
+n1 = 1.00  # air
+n2 = 1.50  # glass
+n3 = 1.33  # water
+t = 10.0   # wall thickness
+
+f = 2.0    # refocused image pixels per mm
+z0 = 5.0   # depth to refocus at
+
+img_w, img_h = 320, 240
+fpx = 800.0
+
+def camera(c):
+
+    # looks at the origin with rows of R as camera axes
+    z = -c/la.norm(c)
+    x = np.cross([0.0, 1.0, 0.0], z); x /= la.norm(x)
+    y = np.cross(z, x)
+    R = np.array([x, y, z])
+    K = np.array([[fpx, 0, img_w*0.5], [0, fpx, img_h*0.5], [0, 0, 1]])
+
+    return K.dot(np.hstack([R, -R.dot(c).reshape(3,1)]))
+
+def refract(c, p):
+
+    # point on the wall that the ray from c to p passes through, found by
+    # bisection on the sine of the ray angle in air
+    rp = la.norm(p[0:2]-c[0:2])
+    da = zW - c[2]
+    dp = p[2] - zW - t
+
+    def lateral(s1):
+        r = 0.0
+        for d, n in ((da, n1), (t, n2), (dp, n3)):
+            s = s1*n1/n
+            r += d*s/np.sqrt(1-s*s)
+        return r
+
+    lo, hi = 0.0, 1.0
+    for i in range(100):
+        mid = 0.5*(lo+hi)
+        if lateral(mid) < rp:
+            lo = mid
+        else:
+            hi = mid
+    s1 = 0.5*(lo+hi)
+    ra = da*s1/np.sqrt(1-s1*s1)
+
+    a = np.array([c[0], c[1], zW])
+    if rp > 0:
+        a[0:2] += (p[0:2]-c[0:2])*ra/rp
+
+    return a
+
+def project(P, a):
+
+    x = P.dot(np.append(a, 1.0))
+    return x[0:2]/x[2]
+
+def sample(img, x, y):
+
+    # bilinear with zeros outside the image, like remap with a constant border
+    x0, y0 = int(np.floor(x)), int(np.floor(y))
+    ax, ay = x-x0, y-y0
+    v = 0.0
+    for dy, wy in ((0, 1-ay), (1, ay)):
+        for dx, wx in ((0, 1-ax), (1, ax)):
+            if 0 <= x0+dx < img_w and 0 <= y0+dy < img_h:
+                v += wx*wy*img[y0+dy, x0+dx]
+    return v
+
+def main():
+
+    gpu = '--gpu' in sys.argv[1:]
+    np.random.seed(0)
+
+    cams, Ps, views = [], [], []
+    for j in range(5):
+        for i in range(5):
+            c = np.array([(i-2)*60.0, (j-2)*60.0, -500.0])
+            cams.append(c)
+            Ps.append(camera(c))
+            img = cv2.GaussianBlur(np.random.rand(img_h, img_w).astype(np.float32), (0, 0), 4)
+            img = (img - img.min())/(img.max() - img.min())
+            views.append(img.astype(np.float32))
+
+    ref = refocusing.saRefocus()
+    ref.setGpuMode(int(gpu))
+    ref.setHF(0)
+    ref.setF(f)
+    for c, P, img in zip(cams, Ps, views):
+        ref.addView(img, P, c.reshape(1,3))
+    ref.setRefractive(1, zW, n1, n2, n3, t)
+    if gpu:
+        ref.initializeGPU()
+
+    # project_point against the independent solver
+
+    err = 0.0
+    for k, (c, P) in enumerate(zip(cams, Ps)):
+        for p in np.random.uniform([-60, -40, 0], [60, 40, 30], (20, 3)):
+            x = np.asarray(ref.project_point(k, p.reshape(3,1))).ravel()
+            err = max(err, la.norm(x - project(P, refract(c, p))))
+    print('max project_point error over 25 cameras: %g px' % err)
+    ok = err < 1e-3
+
+    # refocused image against per camera projections
+
+    out = np.asarray(ref.refocus(z0, 0, 0, 0, 0, 0))
+    if out.shape != (img_h, img_w):
+        print('unexpected refocused image size', out.shape)
+        return 1
+
+    err, n = 0.0, 0
+    for v in range(4, img_h-4, 8):
+        for u in range(4, img_w-4, 8):
+            p = np.array([(u - img_w*0.5)/f, (v - img_h*0.5)/f, z0])
+            xs = [np.asarray(ref.project_point(k, p.reshape(3,1))).ravel() for k in range(len(cams))]
+            # pixels sampled near the border of any view are skipped since
+            # they depend on how the border is interpolated
+            if not all(2 <= x[0] < img_w-3 and 2 <= x[1] < img_h-3 for x in xs):
+                continue
+            expected = np.mean([sample(img, x[0], x[1]) for img, x in zip(views, xs)])
+            err = max(err, abs(out[v, u] - expected))
+            n += 1
+    print('max refocusing error over %d pixels: %g' % (n, err))
+    ok = ok and n > 0 and err < 1e-2
+
+    print('PASS' if ok else 'FAIL')
+    return 0 if ok else 1
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -39,16 +39,16 @@ using namespace gpu;
 
 // Constant variables on device
 __constant__ float Hinv[6];
-__constant__ float PX[9][3];
-__constant__ float P[9][12];
 __constant__ float zW_;
 __constant__ float n1_;
 __constant__ float n2_;
 __constant__ float n3_;
 __constant__ float t_;
+__constant__ int layers_;
+__constant__ refracLayers<float> stack_;
 
 
-__global__ void calc_refocus_map_kernel(PtrStepSzf xmap, PtrStepSzf ymap, float z, int n, int rows, int cols) {
+__global__ void calc_refocus_map_kernel(PtrStepSzf xmap, PtrStepSzf ymap, float z, refracCam cam, int rows, int cols) {
 
     /*
 
@@ -69,13 +69,14 @@ __global__ void calc_refocus_map_kernel(PtrStepSzf xmap, PtrStepSzf ymap, float
         p.z = z;
 
         point Xcam;
-        Xcam.x = PX[n][0]; Xcam.y = PX[n][1]; Xcam.z = PX[n][2];
+        Xcam.x = cam.C[0]; Xcam.y = cam.C[1]; Xcam.z = cam.C[2];
 
         float f, g;
-        point a = point_refrac_fast(Xcam, p, f, g);
+        point a = layers_ > 1 ? point_refrac_layers(Xcam, p) : point_refrac_fast(Xcam, p, f, g);
 
-        xmap.ptr(i)[j] = (P[n][0]*a.x + P[n][1]*a.y + P[n][2]*a.z + P[n][3])/(P[n][8]*a.x + P[n][9]*a.y + P[n][10]*a.z + P[n][11]);
-        ymap.ptr(i)[j] = (P[n][4]*a.x + P[n][5]*a.y + P[n][6]*a.z + P[n][7])/(P[n][8]*a.x + P[n][9]*a.y + P[n][10]*a.z + P[n][11]);
+        const float* P = cam.P;
+        xmap.ptr(i)[j] = (P[0]*a.x + P[1]*a.y + P[2]*a.z + P[3])/(P[8]*a.x + P[9]*a.y + P[10]*a.z + P[11]);
+        ymap.ptr(i)[j] = (P[4]*a.x + P[5]*a.y + P[6]*a.z + P[7])/(P[8]*a.x + P[9]*a.y + P[10]*a.z + P[11]);
 
         //printf("residuals %f, %f\n", f, g);
 
@@ -85,151 +86,31 @@ __global__ void calc_refocus_map_kernel(PtrStepSzf xmap, PtrStepSzf ymap, float
 
 __device__ point point_refrac(point Xcam, point p, float &f, float &g, float zW_, float n1_, float n2_, float n3_, float t_) {
 
-    float c[3];
-    c[0] = Xcam.x; c[1] = Xcam.y; c[2] = Xcam.z;
+    float dx = p.x-Xcam.x, dy = p.y-Xcam.y, dz = p.z-Xcam.z;
+    float rp = sqrtf(dx*dx + dy*dy);
+    float da = zW_-Xcam.z;
 
-    float a[3];
-    float b[3];
-    float pt[3];
-    pt[0] = p.x; pt[1] = p.y; pt[2] = p.z;
-
-    a[0] = c[0] + (pt[0]-c[0])*(zW_-c[2])/(pt[2]-c[2]);
-    a[1] = c[1] + (pt[1]-c[1])*(zW_-c[2])/(pt[2]-c[2]);
-    a[2] = zW_;
-    b[0] = c[0] + (pt[0]-c[0])*(t_+zW_-c[2])/(pt[2]-c[2]);
-    b[1] = c[1] + (pt[1]-c[1])*(t_+zW_-c[2])/(pt[2]-c[2]);
-    b[2] = t_+zW_;
-
-    float rp = sqrt( (pt[0]-c[0])*(pt[0]-c[0]) + (pt[1]-c[1])*(pt[1]-c[1]) );
-    float dp = pt[2]-b[2];
-    float phi = atan2(pt[1]-c[1],pt[0]-c[0]);
-
-    float ra = sqrt( (a[0]-c[0])*(a[0]-c[0]) + (a[1]-c[1])*(a[1]-c[1]) );
-    float rb = sqrt( (b[0]-c[0])*(b[0]-c[0]) + (b[1]-c[1])*(b[1]-c[1]) );
-    float da = a[2]-c[2];
-    float db = b[2]-a[2];
-
-    float dfdra, dfdrb, dgdra, dgdrb;
-
-    float tol = 1E-9;
-    float ra1, rb1, res;
-    ra1 = ra; rb1 = rb;
-
-    // Newton Raphson loop to solve for Snell's law
-    for (int i=0; i<10; i++) {
-
-        f = ( ra/sqrt((ra*ra)+(da*da)) ) - ( (n2_/n1_)*(rb-ra)/sqrt((rb-ra)*(rb-ra) + (db*db)) );
-        g = ( (rb-ra)/sqrt((rb-ra)*(rb-ra)+(db*db)) ) - ( (n3_/n2_)*(rp-rb)/sqrt((rp-rb)*(rp-rb)+(dp*dp)) );
-
-        dfdra = ( 1.0/sqrt((ra*ra)+(da*da)) )
-            - ( (ra*ra)/powf((ra*ra)+(da*da),1.5) )
-            + ( (n2_/n1_)/sqrt((ra-rb)*(ra-rb)+(db*db)) )
-            - ( (n2_/n1_)*(ra-rb)*(2*ra-2*rb)/(2*powf((ra-rb)*(ra-rb)+(db*db),1.5)) );
-
-        dfdrb = ( (n2_/n1_)*(ra-rb)*(2*ra-2*rb)/(2*powf((ra-rb)*(ra-rb)+(db*db),1.5)) )
-            - ( (n2_/n1_)/sqrt((ra-rb)*(ra-rb)+(db*db)) );
-
-        dgdra = ( (ra-rb)*(2*ra-2*rb)/(2*powf((ra-rb)*(ra-rb)+(db*db),1.5)) )
-            - ( (1.0)/sqrt((ra-rb)*(ra-rb)+(db*db)) );
-
-        dgdrb = ( (1.0)/sqrt((ra-rb)*(ra-rb)+(db*db)) )
-            + ( (n3_/n2_)/sqrt((rb-rp)*(rb-rp)+(dp*dp)) )
-            - ( (ra-rb)*(2*ra-2*rb)/(2*powf((ra-rb)*(ra-rb)+(db*db),1.5)) )
-            - ( (n3_/n2_)*(rb-rp)*(2*rb-2*rp)/(2*powf((rb-rp)*(rb-rp)+(dp*dp),1.5)) );
-
-        ra = ra - ( (f*dgdrb - g*dfdrb)/(dfdra*dgdrb - dfdrb*dgdra) );
-        rb = rb - ( (g*dfdra - f*dgdra)/(dfdra*dgdrb - dfdrb*dgdra) );
-
-        res = abs(ra1-ra)+abs(rb1-rb);
-        ra1 = ra; rb1 = rb;
-        if (res < tol)
-            break;
-
-    }
-
-    a[0] = ra*cos(phi) + c[0];
-    a[1] = ra*sin(phi) + c[1];
+    float ra, rb;
+    refrac_initial_guess(rp, dz, da, t_, ra, rb);
+    refrac_solve(rp, da, t_, dz-da-t_, n2_/n1_, n3_/n2_, ra, rb, 4, f, g);
 
+    float r = rp > 0 ? ra/rp : 0;
     point pa;
-    pa.x = a[0]; pa.y = a[1]; pa.z = a[2];
+    pa.x = Xcam.x + dx*r; pa.y = Xcam.y + dy*r; pa.z = zW_;
     return pa;
 
 }
 
 __device__ point point_refrac_fast(point Xcam, point p, float &f, float &g) {
 
-    float c[3];
-    c[0] = Xcam.x; c[1] = Xcam.y; c[2] = Xcam.z;
-
-    float a[3];
-    float b[3];
-    float pt[3];
-    pt[0] = p.x; pt[1] = p.y; pt[2] = p.z;
+    return point_refrac(Xcam, p, f, g, zW_, n1_, n2_, n3_, t_);
 
-    float ptx = pt[0]-c[0]; float pty = pt[1]-c[1]; float ptz = pt[2]-c[2];
-    float zWz = zW_-c[2];
-
-    a[0] = c[0] + (ptx*zWz)/ptz; a[1] = c[1] + (pty*zWz)/ptz; a[2] = zW_;
-    b[0] = c[0] + (ptx*zWz)/ptz; b[1] = c[1] + (pty*zWz)/ptz; b[2] = t_+zW_;
-
-    float rp = sqrt( (ptx*ptx) + (pty*pty) );
-    float dp = pt[2]-b[2];
-    float phi = atan2(pty,ptx);
-
-    float acx = a[0]-c[0]; float acy = a[1]-c[1]; float acz = a[2]-c[2];
-
-    float ra = sqrt( (acx*acx) + (acy*acy) );
-    float rb = sqrt( (b[0]-c[0])*(b[0]-c[0]) + (b[1]-c[1])*(b[1]-c[1]) ); // TODO
-    float da = acz;
-    float db = b[2]-a[2]; // TODO
-
-    float dfdra, dfdrb, dgdra, dgdrb;
-    float rasq, dasq, dbsq, dpsq, rbra, rbrasq, rprb, rprbsq;
-    float n2n1 = n2_/n1_; float n3n2 = n3_/n2_;
-    dasq = da*da; dbsq = db*db; dpsq = dp*dp;
-
-    float tol = 1E-9;
-    float ra1, rb1, res;
-    ra1 = ra; rb1 = rb;
-
-    // Newton Raphson loop to solve for Snell's law
-    for (int i=0; i<10; i++) {
-
-        rasq = ra*ra;
-        rbra = rb-ra; rbrasq = rbra*rbra;
-        rprb = rp-rb; rprbsq = rprb*rprb;
-
-        f = ( ra/sqrt(rasq+dasq) ) - ( (n2n1)*(rbra)/sqrt(rbrasq+dbsq) );
-        g = ( rbra/sqrt(rbrasq+dbsq) ) - ( (n3n2*rprb)/sqrt(rprbsq+dpsq) );
-
-        dfdra = ( 1.0/sqrt(rasq+dasq) )
-            - ( rasq/__powf(rasq+dasq,1.5) )
-            + ( n2n1/sqrt(rbrasq+dbsq) )
-            - ( (n2n1*-rbra)*(2*ra-2*rb)/(2*__powf(rbrasq+dbsq,1.5)) );
-
-        dfdrb = ( (n2n1*-rbra)*(2*ra-2*rb)/(2*__powf(rbrasq+dbsq,1.5)) )
-            - ( n2n1/sqrt(rbrasq+dbsq) );
-
-        dgdra = ( -rbra*(2*ra-2*rb)/(2*__powf(rbrasq+dbsq,1.5)) )
-            - ( 1.0/sqrt(rbrasq+dbsq) );
-
-        dgdrb = ( 1.0/sqrt(rbrasq+dbsq) )
-            + ( n3n2/sqrt(rprbsq+dpsq) )
-            - ( -rbra*(2*ra-2*rb)/(2*__powf(rbrasq+dbsq,1.5)) )
-            - ( (n3n2*-rprb)*(2*rb-2*rp)/(2*__powf(rprbsq+dpsq,1.5)) );
-
-        ra = ra - ( (f*dgdrb - g*dfdrb)/(dfdra*dgdrb - dfdrb*dgdra) );
-        rb = rb - ( (g*dfdra - f*dgdra)/(dfdra*dgdrb - dfdrb*dgdra) );
-
-        res = abs(ra1-ra)+abs(rb1-rb);
-        ra1 = ra; rb1 = rb;
-        if (res < tol)
-            break;
+}
 
-    }
+__device__ point point_refrac_layers(point Xcam, point p) {
 
-    a[0] = ra*cos(phi) + c[0];
-    a[1] = ra*sin(phi) + c[1];
+    float c[3] = {Xcam.x, Xcam.y, Xcam.z}, q[3] = {p.x, p.y, p.z}, a[3];
+    refrac_layers_point(c, q, zW_, stack_, a, 3);
 
     point pa;
     pa.x = a[0]; pa.y = a[1]; pa.z = a[2];
@@ -324,7 +205,7 @@ __global__ void calc_nlca_image(PtrStepSzf nlca_image, PtrStepSzf img1, PtrStepS
 
 }
 
-void uploadRefractiveData(float hinv[6], float locations[9][3], float pmats[9][12], float geom[5]) {
+void uploadRefractiveData(float hinv[6], float* geom, int layers) {
 
     cudaMemcpyToSymbol(Hinv, hinv, sizeof(float)*6);
 
@@ -334,12 +215,14 @@ void uploadRefractiveData(float hinv[6], float locations[9][3], float pmats[9][1
     cudaMemcpyToSymbol(n3_, &geom[3], sizeof(float));
     cudaMemcpyToSymbol(t_, &geom[4], sizeof(float));
 
-    cudaMemcpyToSymbol(PX, locations, 9*3*sizeof(float));
-    cudaMemcpyToSymbol(P, pmats, 9*12*sizeof(float));
+    refracLayers<float> stack;
+    refrac_layers_setup(geom, layers, stack);
+    cudaMemcpyToSymbol(layers_, &layers, sizeof(int));
+    cudaMemcpyToSymbol(stack_, &stack, sizeof(stack));
 
 }
 
-void gpu_calc_refocus_map(GpuMat &xmap, GpuMat &ymap, float z, int i, int rows, int cols) {
+void gpu_calc_refocus_map(GpuMat &xmap, GpuMat &ymap, float z, const refracCam &cam, int rows, int cols) {
 
     dim3 block(32, 32);
     dim3 grid(ceil(cols/16), ceil(rows/16));
@@ -348,7 +231,7 @@ void gpu_calc_refocus_map(GpuMat &xmap, GpuMat &ymap, float z, int i, int rows,
     // dim3 grid(50, 50); dim3 block(10, 10);
 
     if (!cudaGetLastError()) {
-        calc_refocus_map_kernel<<<grid, block>>>(xmap, ymap, z, i, rows, cols);
+        calc_refocus_map_kernel<<<grid, block>>>(xmap, ymap, z, cam, rows, cols);
     } else {
         std::cout<<cudaGetErrorString(cudaGetLastError())<<std::endl;
     }
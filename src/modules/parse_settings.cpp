@@ -39,6 +39,11 @@ boost::program_options::options_description get_options() {
         ("mult", po::value<int>()->default_value(0), "ON to use multiplicative method")
         ("mult_exp", po::value<double>()->default_value(1.0), "Multiplicative method exponent")
         ("minlos", po::value<int>()->default_value(0), "ON to use minimum line of sight method")
+        ("sparse", po::value<int>()->default_value(0), "ON to skip empty regions (mult and minlos only)")
+        ("volume_thresh", po::value<int>()->default_value(0), "ON to threshold volumes using statistics of the whole volume")
+        ("overlap_norm", po::value<int>()->default_value(0), "ON to average pixels over the cameras that see them (additive and NLCA only)")
+        ("pyramid_levels", po::value<int>()->default_value(0), "Number of reduced resolution image levels to build for coarse refocusing")
+        ("incremental_tol", po::value<double>()->default_value(0), "Maximum error (pixels) when refocusing small depth changes by shifting cached images (0 to disable)")
         ("nlca", po::value<int>()->default_value(0), "ON to use nonlinear contrast adjustment")
         ("nlca_fast", po::value<int>()->default_value(0), "ON to use fast nonlinear contrast adjustment")
         ("nlca_win", po::value<int>()->default_value(32), "NLCA window size")
@@ -53,6 +58,16 @@ boost::program_options::options_description get_options() {
         ("resize_images", po::value<int>()->default_value(0), "ON to resize all input images")
         ("rf", po::value<double>()->default_value(1.0), "Factor to resize input images by")
         ("undistort", po::value<int>()->default_value(0), "ON to undistort images")
+        ("int_img_mode", po::value<int>()->default_value(0), "ON to keep 8 and 16 bit images as is (uses less memory)")
+        ("lazy_loading", po::value<int>()->default_value(0), "ON to read frames as they are needed")
+        ("frame_cache_size", po::value<double>()->default_value(2048), "Memory (MB) used for frames when lazy loading")
+        ("prefetch_frames", po::value<int>()->default_value(2), "Number of upcoming frames to read in the background when lazy loading")
+        ("map_cache_size", po::value<double>()->default_value(1024), "Memory (MB) used to cache refractive refocusing maps")
+        ("map_cache_path", po::value<string>()->default_value(""), "path where refractive refocusing maps are persisted")
+        ("ref_map_dz", po::value<double>()->default_value(0), "Depth spacing of exact refractive maps to interpolate between (0 to disable)")
+        ("ref_map_tol", po::value<double>()->default_value(0.01), "Maximum error (pixels) of interpolated refractive maps")
+        ("ref_lut_tol", po::value<double>()->default_value(0), "Maximum error of tabulated refraction solutions (0 to solve refraction exactly)")
+        ("ref_layers", po::value<string>()->default_value(""), "Index and thickness of each refractive layer behind the calibrated wall in format n, t, n, t...")
 
         ("save_path", po::value<string>()->default_value(""), "path where data is saved")
         ("zmin", po::value<double>()->default_value(0), "zmin")
@@ -126,6 +141,11 @@ void parse_refocus_settings(string filename, refocus_settings &settings, bool h)
     settings.mult = vm["mult"].as<int>();
     settings.mult_exp = vm["mult_exp"].as<double>();
     settings.minlos = vm["minlos"].as<int>();
+    settings.sparse = vm["sparse"].as<int>();
+    settings.volume_thresh = vm["volume_thresh"].as<int>();
+    settings.overlap_norm = vm["overlap_norm"].as<int>();
+    settings.pyramid_levels = vm["pyramid_levels"].as<int>();
+    settings.incremental_tol = vm["incremental_tol"].as<double>();
     settings.nlca = vm["nlca"].as<int>();
     settings.nlca_fast = vm["nlca_fast"].as<int>();
     settings.nlca_win = vm["nlca_win"].as<int>();
@@ -134,6 +154,14 @@ void parse_refocus_settings(string filename, refocus_settings &settings, bool h)
     settings.resize_images = vm["resize_images"].as<int>();
     settings.rf = vm["rf"].as<double>();
     settings.undistort = vm["undistort"].as<int>();
+    settings.int_img_mode = vm["int_img_mode"].as<int>();
+    settings.lazy_loading = vm["lazy_loading"].as<int>();
+    settings.frame_cache_size = vm["frame_cache_size"].as<double>();
+    settings.prefetch_frames = vm["prefetch_frames"].as<int>();
+    settings.map_cache_size = vm["map_cache_size"].as<double>();
+    settings.ref_map_dz = vm["ref_map_dz"].as<double>();
+    settings.ref_map_tol = vm["ref_map_tol"].as<double>();
+    settings.ref_lut_tol = vm["ref_lut_tol"].as<double>();
 
     vector<int> frames;
     stringstream frames_stream(vm["frames"].as<string>());
@@ -179,6 +207,18 @@ void parse_refocus_settings(string filename, refocus_settings &settings, bool h)
     }
     settings.shifts = shifts;
 
+    // Reading layers behind the wall
+    vector<double> layers;
+    stringstream layers_stream(vm["ref_layers"].as<string>());
+    double l;
+    while (layers_stream >> l) {
+        layers.push_back(l);
+        if(layers_stream.peek() == ',' || layers_stream.peek() == ' ') {
+            layers_stream.ignore();
+        }
+    }
+    settings.ref_layers = layers;
+
 
     // settings.all_frames = vm["all_frames"].as<int>();
     // if (!settings.all_frames) {
@@ -221,6 +261,15 @@ void parse_refocus_settings(string filename, refocus_settings &settings, bool h)
     if (*settings.images_path.rbegin() != '/')
         settings.images_path += '/';
 
+    boost::filesystem::path mapsP(vm["map_cache_path"].as<string>());
+    if (mapsP.string().empty() || mapsP.is_absolute()) {
+        settings.map_cache_path = mapsP.string();
+    } else {
+        boost::filesystem::path config_file_path = boost::filesystem::canonical(filename, boost::filesystem::current_path());
+        config_file_path.remove_leaf() /= mapsP.string();
+        settings.map_cache_path = config_file_path.string();
+    }
+
 }
 
 /*
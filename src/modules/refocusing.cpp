@@ -34,6 +34,22 @@
 
 #include "refocusing.h"
 #include "tools.h"
+#include "serialization.h"
+#include "refraction.h"
+
+#include <boost/serialization/string.hpp>
+#include <boost/functional/hash.hpp>
+#include <limits>
+
+// AVX kernels are compiled per function and picked at run time, so the rest
+// of the library runs on machines without AVX
+#if defined WITH_AVX && defined __GNUC__ && (defined __x86_64__ || defined __i386__)
+#define REFOCUS_AVX
+#define AVX_TARGET __attribute__((target("avx")))
+#include <immintrin.h>
+#elif defined __SSE2__
+#include <emmintrin.h>
+#endif
 
 using namespace std;
 using namespace cv;
@@ -61,10 +77,25 @@ saRefocus::saRefocus() {
     delta_ = 0.1;
     frames_.push_back(0);
     num_cams_ = 0;
-    IMG_REFRAC_TOL = 1E-9;
+    NR_ITERS = 4;
+    NR_TOL = 1E-9;
     MAX_NR_ITERS = 20;
+    ref_lut_tol_ = 0;
     BENCHMARK_MODE = 0;
     INT_IMG_MODE = 0;
+    tile_rows_ = 16;
+    hsweep_valid_ = 0;
+    ref_map_dz_ = 0; ref_map_tol_ = 0.01;
+    SPARSE_FLAG = 0;
+    LAZY_FLAG = 0;
+    VOLUME_THRESH = 0;
+    OVERLAP_NORM_FLAG = 0;
+    pyramid_levels_ = 0;
+    level_ = 0;
+    incr_tol_ = 0;
+    views_generation_ = 0;
+    std::fill(incr_key_, incr_key_+8, 0.0);
+    scratch_.reset(new boost::thread_specific_ptr<scratchArena>);
 
     z_ = 0; dz_ = 0.1;
     xs_ = 0; ys_ = 0; zs_ = 0; dx_ = 0.1; dy_ = 0.1;
@@ -91,10 +122,25 @@ saRefocus::saRefocus(int num_cams, double f) {
     frames_.push_back(0);
     num_cams_ = num_cams;
     scale_ = f;
-    IMG_REFRAC_TOL = 1E-9;
+    NR_ITERS = 4;
+    NR_TOL = 1E-9;
     MAX_NR_ITERS = 20;
+    ref_lut_tol_ = 0;
     BENCHMARK_MODE = 0;
     INT_IMG_MODE = 0;
+    tile_rows_ = 16;
+    hsweep_valid_ = 0;
+    ref_map_dz_ = 0; ref_map_tol_ = 0.01;
+    SPARSE_FLAG = 0;
+    LAZY_FLAG = 0;
+    VOLUME_THRESH = 0;
+    OVERLAP_NORM_FLAG = 0;
+    pyramid_levels_ = 0;
+    level_ = 0;
+    incr_tol_ = 0;
+    views_generation_ = 0;
+    std::fill(incr_key_, incr_key_+8, 0.0);
+    scratch_.reset(new boost::thread_specific_ptr<scratchArena>);
 
 }
 
@@ -108,14 +154,35 @@ saRefocus::saRefocus(refocus_settings settings):
 
     GPU_MATS_UPLOADED=false;
     STDEV_THRESH = 1;
-    IMG_REFRAC_TOL = 1E-9;
+    NR_ITERS = 4;
+    NR_TOL = 1E-9;
     MAX_NR_ITERS = 20;
+    ref_lut_tol_ = 0;
     BENCHMARK_MODE = 0;
-    INT_IMG_MODE = 0;
+    INT_IMG_MODE = settings.int_img_mode;
     SINGLE_CAM_DEBUG = 0;
+    tile_rows_ = 16;
+    hsweep_valid_ = 0;
+    map_cache_.setCapacity(settings.map_cache_size);
+    map_cache_.setPath(settings.map_cache_path);
+    setRefMapInterp(settings.ref_map_dz, settings.ref_map_tol);
+    SPARSE_FLAG = settings.sparse;
+    LAZY_FLAG = settings.lazy_loading;
+    VOLUME_THRESH = settings.volume_thresh;
+    OVERLAP_NORM_FLAG = settings.overlap_norm;
+    pyramid_levels_ = settings.pyramid_levels;
+    level_ = 0;
+    setIncrementalTol(settings.incremental_tol);
+    views_generation_ = 0;
+    std::fill(incr_key_, incr_key_+8, 0.0);
+    ref_lut_tol_ = settings.ref_lut_tol;
+    scratch_.reset(new boost::thread_specific_ptr<scratchArena>);
+    frame_cache_size_ = settings.frame_cache_size;
+    prefetch_frames_ = settings.prefetch_frames;
 
     imgs_read_ = 0;
     read_calib_data(settings.calib_file_path);
+    setRefractiveLayers(settings.ref_layers);
 
     if (mult_ + minlos_ + nlca_ + nlca_fast_ > 1)
         LOG(FATAL) << "Multiple reconstructions options (mult, minlos, nlca, nlca_fast) cannot be ON!";
@@ -143,9 +210,10 @@ saRefocus::saRefocus(refocus_settings settings):
 
     }
 
+    // The CPU engine handles any number of cameras
     if (nlca_ || nlca_fast_)
-        if (num_cams_ != 4)
-            LOG(FATAL) << "NLCA and fast NLCA modes are currently only supported for 4 cameras!";
+        if (GPU_FLAG && num_cams_ != 4)
+            LOG(FATAL) << "NLCA and fast NLCA modes are currently only supported for 4 cameras on the GPU!";
 
 #ifndef WITHOUT_CUDA
     if (GPU_FLAG) {
@@ -220,6 +288,7 @@ void saRefocus::read_calib_data(string path) {
     if (REF_FLAG) {
         VLOG(1)<<"Calibration is refractive";
         file>>geom[0]; file>>geom[4]; file>>geom[1]; file>>geom[2]; file>>geom[3];
+        build_ref_luts();
     } else {
         VLOG(1)<<"Calibration is pinhole";
     }
@@ -261,6 +330,7 @@ void saRefocus::read_imgs(string path) {
         VLOG(1)<<"UNDISTORT_IMAGES flag is "<<UNDISTORT_IMAGES;
         
         int size = 0;
+        vector< vector<string> > frame_names;
         for (int i=0; i<num_cams_; i++) {
 
             VLOG(1)<<"Camera "<<i+1<<" of "<<num_cams_<<"..."<<endl;
@@ -329,9 +399,25 @@ void saRefocus::read_imgs(string path) {
                 }
             }
 
+            vector<string> frame_names_sub;
             for (int j=begin; j<end; j+=skip+1) {
 
                 VLOG(1)<<j<<": "<<img_names.at(j)<<endl;
+
+                if (LAZY_FLAG) {
+                    // Only the first image is decoded up front to get the
+                    // image size
+                    if (i==0 && j==begin) {
+                        image = imread(img_names.at(j), 0);
+                        img_size_ = Size(image.cols, image.rows);
+                        updateHinv();
+                    }
+                    frame_names_sub.push_back(img_names.at(j));
+                    if (i==0)
+                        frames_.push_back(j);
+                    continue;
+                }
+
                 image = imread(img_names.at(j), 0);
 
                 if (j==begin) {
@@ -354,7 +440,10 @@ void saRefocus::read_imgs(string path) {
             }
             img_names.clear();
 
-            imgs.push_back(refocusing_imgs_sub);
+            if (LAZY_FLAG)
+                frame_names.push_back(frame_names_sub);
+            else
+                imgs.push_back(refocusing_imgs_sub);
             path_tmp = "";
 
             VLOG(1)<<"done!\n";
@@ -362,6 +451,11 @@ void saRefocus::read_imgs(string path) {
 
         }
 
+        if (LAZY_FLAG) {
+            LOG(INFO) << "Frames will be read as they are needed";
+            frame_cache_.reset(new frameCache(new imageFolderSource(frame_names, K_mats_, dist_coeffs_, UNDISTORT_IMAGES), num_cams_, frame_cache_size_, prefetch_frames_));
+        }
+
         generate_stack_names();
         initializeRefocus();
 
@@ -432,14 +526,25 @@ void saRefocus::read_imgs_mtiff(string path) {
             frames_.push_back(i);
     }
 
+    for (int n=0; n<img_names.size(); n++)
+        if (frames_.back() > tiffs[n].num_frames())
+            LOG(FATAL) << "End frame greater than the number of frames in " << img_names[n] << "!";
+
+    if (LAZY_FLAG) {
+        LOG(INFO) << "Frames will be read as they are needed";
+        frame_cache_.reset(new frameCache(new mtiffSource(tiffs, frames_), num_cams_, frame_cache_size_, prefetch_frames_));
+        Mat img = frame_cache_->get(0, 0);
+        img_size_ = Size(img.cols, img.rows);
+        updateHinv();
+        initializeRefocus();
+        return;
+    }
+
     VLOG(1)<<"Reading images...";
     for (int n=0; n<img_names.size(); n++) {
 
         VLOG(1)<<"Camera "<<n+1<<"...";
 
-        if (frames_.back() > tiffs[n].num_frames())
-            LOG(FATAL) << "End frame greater than the number of frames in " << img_names[n] << "!";
-
         vector<Mat> refocusing_imgs_sub;
         int count=0;
         for (int f=0; f<frames_.size(); f++) {
@@ -515,7 +620,7 @@ void saRefocus::CPUliveView() {
                         thresh_ -= dthresh;
                 }
             } else if( (key & 255)==46 ) { // >
-                if (active_frame_<imgs[0].size()-1) {
+                if (active_frame_<num_frames()-1) {
                     active_frame_++;
                 }
             } else if( (key & 255)==44 ) { // <
@@ -642,57 +747,32 @@ void saRefocus::initializeRefocus() {
     // on the datatype
     // TODO: add ability to handle more data types
 
-    int type = imgs[0][0].type();
-
-    for (int i=0; i<imgs.size(); i++) {
-        for (int j=0; j<imgs[i].size(); j++) {
-
-            Mat img;
-            switch(type) {
-
-            case CV_8U:
-                if (INT_IMG_MODE) {
-                    break;
-                }
-                if (i==0 && j==0) {
-                    VLOG(3)<<"Converting images from CV_8U type to CV_32F type...";
-                }
-                imgs[i][j].convertTo(img, CV_32F);
-                img /= 255.0;
-                imgs[i][j] = img.clone();
-                break;
-
-            case CV_16U:
-                if (i==0 && j==0) {
-                    VLOG(3)<<"Converting images from CV_16U type to CV_32F type...";
-                }
-                imgs[i][j].convertTo(img, CV_32F);
-                img /= 65535.0;
-                imgs[i][j] = img.clone();
-                break;
-
-            case CV_32F:
-                if (i==0 && j==0) {
-                    VLOG(3)<<"Images already CV_32F type...";
-                }
-                break;
+    if (INT_IMG_MODE && weighting_mode_ > 0) {
+        LOG(WARNING) << "Weighting requires float images! Turning integer image mode OFF.";
+        INT_IMG_MODE = 0;
+    }
 
-            case CV_64F:
-                if (i==0 && j==0) {
-                    VLOG(3)<<"Converting images from CV_64F type to CV_32F type...";
-                }
-                imgs[i][j].convertTo(img, CV_32F);
-                imgs[i][j] = img.clone();
-                break;
+    int keep_8bit = INT_IMG_MODE;
+    // Only the CPU path handles 16 bit images natively
+    int keep_16bit = INT_IMG_MODE && !GPU_FLAG;
 
-            }
+    views_generation_++;
 
-        }
+    if (frame_cache_) {
+        // Frames are converted and weighted as they are decoded
+        frame_cache_->setConversion(keep_8bit, keep_16bit, weighting_mode_);
+        return;
     }
 
+    for (int i=0; i<imgs.size(); i++)
+        for (int j=0; j<imgs[i].size(); j++)
+            convert_frame(imgs[i][j], keep_8bit, keep_16bit, i==0 && j==0);
+
     if (weighting_mode_ > 0)
         weight_images();
 
+    build_pyramids();
+
     // preprocess();
 
 }
@@ -755,10 +835,253 @@ Mat saRefocus::refocus(double z, double rx, double ry, double rz, double thresh,
 
     }
 
+    // GPU kernels refocus full images so the region of interest is cut out
+    // afterwards
+    if (GPU_FLAG && roi_.area()) {
+        if (out_buf_.data) {
+            result_(roi_).convertTo(out_buf_, CV_32F);
+            result_ = out_buf_;
+        } else {
+            result_ = result_(roi_).clone();
+        }
+    }
+
     return(result_);
 
 }
 
+void saRefocus::refocus_into(double z, double rx, double ry, double rz, double thresh, int frame, Mat out) {
+
+    if (out.size() != refocused_size() || out.type() != CV_32F)
+        LOG(FATAL) << "Output buffer must be a CV_32F image of the refocused image size!";
+
+    out_buf_ = out;
+    refocus(z, rx, ry, rz, thresh, frame);
+    out_buf_ = Mat();
+    result_ = Mat();
+
+}
+
+// Image the CPU engine writes the refocused image into: the caller's buffer
+// during refocus_into(), otherwise one that is reused between calls
+Mat saRefocus::cpu_output_buffer() {
+
+    if (out_buf_.data)
+        return out_buf_;
+    cpurefocused.create(refocused_size(), CV_32F);
+    return cpurefocused;
+
+}
+
+// Stores a refocused image as the result. Images already in the caller's
+// buffer are not copied and ones of its size are converted straight into it.
+// Otherwise a copy is kept as the refocusing buffers are reused.
+void saRefocus::set_result(const Mat &img) {
+
+    if (out_buf_.data && img.size() == out_buf_.size()) {
+        if (img.data != out_buf_.data)
+            img.convertTo(out_buf_, CV_32F);
+        result_ = out_buf_;
+        return;
+    }
+
+    result_ = img.clone();
+
+}
+
+Mat saRefocus::refocus_volume(double zmin, double zmax, double dz, double thresh, int frame) {
+
+    rx_ = 0; ry_ = 0; rz_ = 0;
+    if (STDEV_THRESH) {
+        thresh_ = thresh;
+    } else {
+        thresh_ = thresh/255.0;
+    }
+
+    if (dz <= 0)
+        LOG(FATAL) << "dz must be positive to refocus a volume!";
+
+    // Depths are calculated from their index rather than accumulated so
+    // that rounding does not decide whether the last plane is included
+    int num_planes = int(floor((zmax-zmin)/dz + 1e-6)) + 1;
+    if (num_planes < 1)
+        LOG(FATAL) << "zmax must be greater than or equal to zmin to refocus a volume!";
+
+    // Refocused images are always float, also in integer image mode
+    int type = CV_32F;
+    Size size = refocused_size();
+    Mat volume(num_planes*size.height, size.width, type);
+    vector<Mat> planes = get_planes(volume);
+
+    if (!GPU_FLAG && !(REF_FLAG && !CORNER_FLAG)) {
+
+        // All homographies are calculated up front so that every
+        // plane and tile can be refocused in one parallel call
+        vector< vector<Mat> > Ms(num_planes);
+        for (int k=0; k<num_planes; k++) {
+            z_ = zmin + k*dz;
+            calc_inverse_Hs(Ms[k]);
+        }
+
+        CPUrefocus_tiles(Ms, frame, planes, !REF_FLAG);
+
+    } else {
+
+        if (VOLUME_THRESH)
+            LOG_FIRST_N(WARNING, 1) << "Volume thresholds are only supported by the CPU homography refocusing engine. Thresholding each plane separately.";
+
+        for (int k=0; k<num_planes; k++)
+            refocus_into(zmin + k*dz, 0, 0, 0, thresh, frame, planes[k]);
+
+    }
+
+    return(volume);
+
+}
+
+Mat saRefocus::refocus_planes(Mat planes, double thresh, int frame) {
+
+    if (STDEV_THRESH) {
+        thresh_ = thresh;
+    } else {
+        thresh_ = thresh/255.0;
+    }
+
+    if (planes.cols != 4 || planes.rows < 1 || planes.channels() != 1)
+        LOG(FATAL) << "Planes must be given as rows of (nx, ny, nz, d)!";
+
+    if (GPU_FLAG || (REF_FLAG && !CORNER_FLAG))
+        LOG(FATAL) << "Refocusing batches of planes is only supported by the CPU homography refocusing engine!";
+
+    Mat_<double> poses;
+    planes.convertTo(poses, CV_64F);
+    int num_planes = poses.rows;
+
+    Size size = refocused_size();
+    Mat volume(num_planes*size.height, size.width, CV_32F);
+    vector<Mat> vplanes = get_planes(volume);
+
+    vector< vector<Mat> > Ms;
+    calc_plane_Hs_inv(poses, Ms);
+
+    CPUrefocus_tiles(Ms, frame, vplanes, !REF_FLAG);
+
+    return(volume);
+
+}
+
+int saRefocus::num_frames() {
+
+    if (frame_cache_)
+        return frame_cache_->num_frames();
+    return imgs[0].size();
+
+}
+
+Mat saRefocus::get_view(int cam, int frame) {
+
+    // Lazily loaded frames are reduced and cached by the frame cache
+    if (frame_cache_)
+        return frame_cache_->get(cam, frame, level_);
+
+    if (!level_)
+        return imgs[cam][frame];
+
+    return pyr_imgs_[level_-1][cam][frame];
+
+}
+
+// Builds pyramid_levels_ reduced copies of all loaded images. Cameras before
+// first_cam are assumed to be unchanged and are kept if present.
+void saRefocus::build_pyramids(int first_cam) {
+
+    if (!pyramid_levels_ || frame_cache_) {
+        pyr_imgs_.clear();
+        return;
+    }
+
+    if (pyr_imgs_.size() != pyramid_levels_ || pyr_imgs_[0].size() < first_cam)
+        first_cam = 0;
+    if (!first_cam)
+        pyr_imgs_.clear();
+
+    VLOG(1) << "Building " << pyramid_levels_ << " level image pyramid...";
+
+    pyr_imgs_.resize(pyramid_levels_);
+    for (int l=0; l<pyramid_levels_; l++) {
+        const vector< vector<Mat> > &src = l ? pyr_imgs_[l-1] : imgs;
+        pyr_imgs_[l].resize(src.size());
+        for (int i=first_cam; i<src.size(); i++) {
+            // Fresh images so that views handed out earlier are not overwritten
+            pyr_imgs_[l][i].assign(src[i].size(), Mat());
+            for (int j=0; j<src[i].size(); j++)
+                pyrDown(src[i][j], pyr_imgs_[l][i][j]);
+        }
+    }
+
+}
+
+Size saRefocus::refocused_size() {
+
+    // Each pyramid level halves the size, rounding up like pyrDown
+    Size size = roi().size();
+    for (int l=0; l<level_; l++)
+        size = Size((size.width+1)/2, (size.height+1)/2);
+    return size;
+
+}
+
+void saRefocus::setPyramidLevels(int levels) {
+
+    if (levels < 0)
+        LOG(FATAL) << "Number of pyramid levels cannot be negative!";
+
+    pyramid_levels_ = levels;
+    if (level_ > pyramid_levels_)
+        level_ = 0;
+    build_pyramids();
+
+}
+
+void saRefocus::setPyramidLevel(int level) {
+
+    if (level < 0 || level > pyramid_levels_)
+        LOG(FATAL) << "Pyramid level " << level << " has not been built! Use setPyramidLevels() first.";
+
+    if (level && (GPU_FLAG || (REF_FLAG && !CORNER_FLAG)))
+        LOG(FATAL) << "Refocusing at reduced resolution is only supported by the CPU homography refocusing engine!";
+
+    level_ = level;
+
+}
+
+// Adapts inverse homographies of full resolution images to the images and
+// refocused images of the current pyramid level, where pixel x corresponds
+// to pixel 2^level*x at full resolution
+void saRefocus::scale_to_level(vector<Mat> &Ms) {
+
+    if (!level_)
+        return;
+
+    double f = 1 << level_;
+    Mat up = (Mat_<double>(3,3) << f, 0, 0, 0, f, 0, 0, 0, 1);
+    Mat down = (Mat_<double>(3,3) << 1/f, 0, 0, 0, 1/f, 0, 0, 0, 1);
+    for (int i=0; i<Ms.size(); i++)
+        Ms[i] = down*Ms[i]*up;
+
+}
+
+vector<Mat> saRefocus::get_planes(Mat volume) {
+
+    int height = refocused_size().height;
+    vector<Mat> planes;
+    for (int k=0; k<volume.rows/height; k++)
+        planes.push_back(volume.rowRange(k*height, (k+1)*height));
+
+    return(planes);
+
+}
+
 #ifndef WITHOUT_CUDA
 
 // ---GPU Refocusing Functions Begin--- //
@@ -826,9 +1149,9 @@ void saRefocus::uploadAllToGPU() {
     }
 
     VLOG(1)<<"Uploading all frames to GPU...";
-    for (int i=0; i<imgs[0].size(); i++) {
+    for (int i=0; i<num_frames(); i++) {
         for (int j=0; j<num_cams_; j++) {
-            temp.upload(imgs[j][i]);
+            temp.upload(get_view(j, i));
             array.push_back(temp.clone());
         }
         array_all.push_back(array);
@@ -865,7 +1188,7 @@ void saRefocus::uploadSingleToGPU(int frame) {
     array_all.clear();
     array.clear();
     for (int j=0; j<num_cams_; j++) {
-        temp.upload(imgs[j][frame]);
+        temp.upload(get_view(j, frame));
         array.push_back(temp.clone());
     }
     array_all.push_back(array);
@@ -887,25 +1210,31 @@ void saRefocus::uploadToGPU_ref() {
     hinv[0] = Dinv.at<float>(0,0); hinv[1] = Dinv.at<float>(0,1); hinv[2] = Dinv.at<float>(0,2);
     hinv[3] = Dinv.at<float>(1,0); hinv[4] = Dinv.at<float>(1,1); hinv[5] = Dinv.at<float>(1,2);
 
-    float locations[9][3];
-    float pmats[9][12];
-    for (int i=0; i<9; i++) {
+    // Camera tables are passed to the map kernel by value for each camera
+    ref_cams_.resize(num_cams_);
+    for (int i=0; i<num_cams_; i++) {
         for (int j=0; j<3; j++) {
-            locations[i][j] = cam_locations_[i].at<double>(j,0);
+            ref_cams_[i].C[j] = cam_locations_[i].at<double>(j,0);
             for (int k=0; k<4; k++) {
-                pmats[i][j*4+k] = P_mats_[i].at<double>(j,k);
+                ref_cams_[i].P[j*4+k] = P_mats_[i].at<double>(j,k);
             }
         }
     }
 
-    uploadRefractiveData(hinv, locations, pmats, geom);
+    double g[REFRAC_GEOM_SIZE(REFRAC_MAX_LAYERS)];
+    float gf[REFRAC_GEOM_SIZE(REFRAC_MAX_LAYERS)];
+    int layers = ref_geom(g);
+    for (int i=0; i<REFRAC_GEOM_SIZE(layers); i++)
+        gf[i] = g[i];
+    uploadRefractiveData(hinv, gf, layers);
 
     Mat blank(img_size_.height, img_size_.width, CV_32F, float(0));
     xmap.upload(blank); ymap.upload(blank);
     temp.upload(blank); temp2.upload(blank);
     // refocused.upload(blank);
 
-    for (int i=0; i<9; i++) {
+    xmaps.clear(); ymaps.clear();
+    for (int i=0; i<num_cams_; i++) {
         xmaps.push_back(xmap.clone());
         ymaps.push_back(ymap.clone());
     }
@@ -974,7 +1303,7 @@ void saRefocus::GPUrefocus(int live, int frame) {
         liveViewWindow(refocused_host_);
 
     //refocused_host_.convertTo(result, CV_8U);
-    result_ = refocused_host_.clone();
+    set_result(refocused_host_);
 
 }
 
@@ -987,7 +1316,7 @@ void saRefocus::GPUrefocus_ref(int live, int frame) {
 
     for (int i=0; i<num_cams_; i++) {
 
-        gpu_calc_refocus_map(xmap, ymap, z_, i, img_size_.height, img_size_.width);
+        gpu_calc_refocus_map(xmap, ymap, z_, ref_cams_[i], img_size_.height, img_size_.width);
         gpu::remap(array_all[frame][i], warped_[i], xmap, ymap, INTER_LINEAR);
 
         if (i==0) {
@@ -1009,7 +1338,7 @@ void saRefocus::GPUrefocus_ref(int live, int frame) {
     if (live)
         liveViewWindow(refocused_host_);
 
-    result_ = refocused_host_.clone();
+    set_result(refocused_host_);
 
 }
 
@@ -1063,7 +1392,7 @@ void saRefocus::GPUrefocus_ref_corner(int live, int frame) {
     if (live)
         liveViewWindow(refocused_host_);
 
-    result_ = refocused_host_.clone();
+    set_result(refocused_host_);
 
 }
 
@@ -1318,190 +1647,2022 @@ void saRefocus::updateLiveFrame() {
 
 // ---CPU Refocusing Functions Begin--- //
 
-void saRefocus::CPUrefocus(int live, int frame) {
+// Warps rows r0 to r1 of a dsize sized perspective warp of src into dst where
+// M is the inverse (destination to source) homography. The fixed point maps
+// are generated exactly the way cv::warpPerspective generates them internally
+// (including its 64 column block structure) so that a tiled warp is bitwise
+// identical to warping the full image at once.
+static void warp_perspective_rows(const Mat &src, Mat &dst, const double* M, Size dsize, int r0, int r1, Mat &xy, Mat &alpha) {
 
-    Scalar fact = Scalar(1/double(num_cams_));
+    const int BLOCK_SZ = 32;
+    int bh0 = std::min(BLOCK_SZ/2, dsize.height);
+    int bw0 = std::min(BLOCK_SZ*BLOCK_SZ/bh0, dsize.width);
 
-    Mat H, trans;
-    calc_refocus_H(0, H);
-    warpPerspective(imgs[0][frame], cputemp, H, img_size_);
-    // qimshow(cputemp);
-
-    if (mult_) {
-        pow(cputemp, mult_exp_, cputemp2);
-    } else if (minlos_) {
-        cputemp2 = cputemp.clone();
-    } else {
-        multiply(cputemp, fact, cputemp2);
-    }
+    xy.create(r1-r0, dsize.width, CV_16SC2);
+    alpha.create(r1-r0, dsize.width, CV_16UC1);
 
-    cpurefocused = cputemp2.clone();
+    for (int y=r0; y<r1; y++) {
 
-    for (int i=1; i<num_cams_; i++) {
+        short* xyr = xy.ptr<short>(y-r0);
+        ushort* ar = alpha.ptr<ushort>(y-r0);
 
-        calc_refocus_H(i, H);
-        warpPerspective(imgs[i][frame], cputemp, H, img_size_);
-        // qimshow(cputemp);
+        for (int x=0; x<dsize.width; x+=bw0) {
 
-        if (mult_) {
-            pow(cputemp, mult_exp_, cputemp2);
-            multiply(cpurefocused, cputemp2, cpurefocused);
-	} else if (minlos_) {
-	    min(cputemp,cpurefocused,cpurefocused);
-        } else {
-            multiply(cputemp, fact, cputemp2);
-            add(cpurefocused, cputemp2, cpurefocused);
-        }
-    }
+            int bw = std::min(bw0, dsize.width-x);
+            double X0 = M[0]*x + M[1]*y + M[2];
+            double Y0 = M[3]*x + M[4]*y + M[5];
+            double W0 = M[6]*x + M[7]*y + M[8];
+
+            for (int x1=0; x1<bw; x1++) {
+                double W = W0 + M[6]*x1;
+                W = W ? INTER_TAB_SIZE/W : 0;
+                double fX = std::max((double)INT_MIN, std::min((double)INT_MAX, (X0 + M[0]*x1)*W));
+                double fY = std::max((double)INT_MIN, std::min((double)INT_MAX, (Y0 + M[3]*x1)*W));
+                int X = saturate_cast<int>(fX);
+                int Y = saturate_cast<int>(fY);
 
-    threshold(cpurefocused, cpurefocused, thresh_, 0, THRESH_TOZERO);
+                xyr[(x+x1)*2] = saturate_cast<short>(X >> INTER_BITS);
+                xyr[(x+x1)*2+1] = saturate_cast<short>(Y >> INTER_BITS);
+                ar[x+x1] = (ushort)((Y & (INTER_TAB_SIZE-1))*INTER_TAB_SIZE + (X & (INTER_TAB_SIZE-1)));
+            }
 
-    Mat refocused_host_(cpurefocused);
+        }
 
-    if (live)
-        liveViewWindow(refocused_host_);
+    }
 
-    result_ = refocused_host_.clone();
+    remap(src, dst, xy, alpha, INTER_LINEAR, BORDER_CONSTANT, Scalar());
 
 }
 
-void saRefocus::CPUrefocus_ref(int live, int frame) {
+// Bilinear weights for each INTER_TAB_SIZE x INTER_TAB_SIZE sub pixel
+// position, calculated and ordered the same way remap does
+static void init_bilinear_tab(vector<float> &tab) {
+
+    tab.resize(INTER_TAB_SIZE*INTER_TAB_SIZE*4);
+    for (int ty=0; ty<INTER_TAB_SIZE; ty++) {
+        float fy = ty*1.f/INTER_TAB_SIZE;
+        for (int tx=0; tx<INTER_TAB_SIZE; tx++) {
+            float fx = tx*1.f/INTER_TAB_SIZE;
+            float* w = &tab[(ty*INTER_TAB_SIZE + tx)*4];
+            w[0] = (1.f-fy)*(1.f-fx); w[1] = (1.f-fy)*fx;
+            w[2] = fy*(1.f-fx); w[3] = fy*fx;
+        }
+    }
 
-    Mat_<double> x = Mat_<double>::zeros(img_size_.height, img_size_.width);
-    Mat_<double> y = Mat_<double>::zeros(img_size_.height, img_size_.width);
-    calc_ref_refocus_map(cam_locations_[0], z_, x, y, 0);
+}
 
-    Mat res, xmap, ymap;
-    x.convertTo(xmap, CV_32FC1);
-    y.convertTo(ymap, CV_32FC1);
-    remap(imgs[0][frame], res, xmap, ymap, INTER_LINEAR);
+// Integer bilinear weights summing to INTER_REMAP_COEF_SCALE, as remap uses
+// for integer images. Like initInterTab2D, an excess is taken from the
+// smallest tap and a deficit added to the largest one.
+static void init_bilinear_tab_int(const vector<float> &tab, vector<int> &itab) {
+
+    itab.resize(tab.size());
+    for (int k=0; k<tab.size(); k+=4) {
+        int isum = 0, jmin = 0, jmax = 0;
+        for (int j=0; j<4; j++) {
+            itab[k+j] = saturate_cast<short>(tab[k+j]*INTER_REMAP_COEF_SCALE);
+            isum += itab[k+j];
+        }
+        for (int j=0; j<4; j++) {
+            if (itab[k+j] < itab[k+jmin])
+                jmin = j;
+            else if (itab[k+j] > itab[k+jmax])
+                jmax = j;
+        }
+        int diff = isum - INTER_REMAP_COEF_SCALE;
+        if (diff < 0)
+            itab[k+jmax] -= diff;
+        else if (diff > 0)
+            itab[k+jmin] -= diff;
+    }
 
-    refocused_host_ = res.clone()/double(num_cams_);
+}
 
-    for (int i=1; i<num_cams_; i++) {
+static inline float bilinear_cast(float v) { return v; }
+static inline int bilinear_cast(int v) { return (v + (1 << (INTER_REMAP_COEF_BITS-1))) >> INTER_REMAP_COEF_BITS; }
+
+#if defined REFOCUS_AVX
+static AVX_TARGET int warp_coords_avx(const double* M, double X0, double Y0, double W0, int a, int n, int* X, int* Y) {
+
+    __m256d m0 = _mm256_set1_pd(M[0]), m3 = _mm256_set1_pd(M[3]), m6 = _mm256_set1_pd(M[6]);
+    __m256d x0 = _mm256_set1_pd(X0), y0 = _mm256_set1_pd(Y0), w0 = _mm256_set1_pd(W0);
+    __m256d tab = _mm256_set1_pd(INTER_TAB_SIZE), zero = _mm256_setzero_pd();
+    __m256d lo = _mm256_set1_pd(INT_MIN), hi = _mm256_set1_pd(INT_MAX);
+
+    int k = 0;
+    for ( ; k <= n-4; k += 4) {
+        __m256d x1 = _mm256_setr_pd(a+k, a+k+1, a+k+2, a+k+3);
+        __m256d W = _mm256_add_pd(w0, _mm256_mul_pd(m6, x1));
+        W = _mm256_and_pd(_mm256_div_pd(tab, W), _mm256_cmp_pd(W, zero, _CMP_NEQ_UQ));
+        __m256d fX = _mm256_max_pd(_mm256_min_pd(_mm256_mul_pd(_mm256_add_pd(x0, _mm256_mul_pd(m0, x1)), W), hi), lo);
+        __m256d fY = _mm256_max_pd(_mm256_min_pd(_mm256_mul_pd(_mm256_add_pd(y0, _mm256_mul_pd(m3, x1)), W), hi), lo);
+        _mm_storeu_si128((__m128i*)(X + k), _mm256_cvtpd_epi32(fX));
+        _mm_storeu_si128((__m128i*)(Y + k), _mm256_cvtpd_epi32(fY));
+    }
 
-        calc_ref_refocus_map(cam_locations_[i], z_, x, y, i);
-        x.convertTo(xmap, CV_32FC1);
-        y.convertTo(ymap, CV_32FC1);
+    return k;
 
-        remap(imgs[i][frame], res, xmap, ymap, INTER_LINEAR);
+}
+#endif
 
-        refocused_host_ += res.clone()/double(num_cams_);
+// Source pixels (sx, sy) and offsets wofs of their bilinear weights in the
+// weight table for columns x+a to x+b-1 of output row y. Coordinates are
+// generated exactly like warp_perspective_rows, several columns at a time.
+static void warp_coords(const double* M, int x, int y, int a, int b, int* sx, int* sy, int* wofs, int simd) {
+
+    double X0 = M[0]*x + M[1]*y + M[2];
+    double Y0 = M[3]*x + M[4]*y + M[5];
+    double W0 = M[6]*x + M[7]*y + M[8];
+    int n = b-a;
+    int k = 0;
+
+    // Fixed point coordinates first go to sx and sy
+#if defined REFOCUS_AVX
+    if (simd > 1)
+        k = warp_coords_avx(M, X0, Y0, W0, a, n, sx, sy);
+#endif
 
+#if defined __SSE2__
+    if (simd > 0) {
+        __m128d m0 = _mm_set1_pd(M[0]), m3 = _mm_set1_pd(M[3]), m6 = _mm_set1_pd(M[6]);
+        __m128d x0 = _mm_set1_pd(X0), y0 = _mm_set1_pd(Y0), w0 = _mm_set1_pd(W0);
+        __m128d tab = _mm_set1_pd(INTER_TAB_SIZE), zero = _mm_setzero_pd();
+        __m128d lo = _mm_set1_pd(INT_MIN), hi = _mm_set1_pd(INT_MAX);
+        for ( ; k <= n-2; k += 2) {
+            __m128d x1 = _mm_setr_pd(a+k, a+k+1);
+            __m128d W = _mm_add_pd(w0, _mm_mul_pd(m6, x1));
+            W = _mm_and_pd(_mm_div_pd(tab, W), _mm_cmpneq_pd(W, zero));
+            __m128d fX = _mm_max_pd(_mm_min_pd(_mm_mul_pd(_mm_add_pd(x0, _mm_mul_pd(m0, x1)), W), hi), lo);
+            __m128d fY = _mm_max_pd(_mm_min_pd(_mm_mul_pd(_mm_add_pd(y0, _mm_mul_pd(m3, x1)), W), hi), lo);
+            _mm_storel_epi64((__m128i*)(sx + k), _mm_cvtpd_epi32(fX));
+            _mm_storel_epi64((__m128i*)(sy + k), _mm_cvtpd_epi32(fY));
+        }
     }
+#endif
 
-    // TODO: thresholding missing?
+    for ( ; k < n; k++) {
+        int x1 = a+k;
+        double W = W0 + M[6]*x1;
+        W = W ? INTER_TAB_SIZE/W : 0;
+        double fX = std::max((double)INT_MIN, std::min((double)INT_MAX, (X0 + M[0]*x1)*W));
+        double fY = std::max((double)INT_MIN, std::min((double)INT_MAX, (Y0 + M[3]*x1)*W));
+        sx[k] = saturate_cast<int>(fX);
+        sy[k] = saturate_cast<int>(fY);
+    }
 
-    if (live)
-        liveViewWindow(refocused_host_);
+    // Split into whole pixels and sub pixel weight offsets
+    k = 0;
+
+#if defined __SSE2__
+    if (simd > 0) {
+        __m128i mask = _mm_set1_epi32(INTER_TAB_SIZE-1);
+        for ( ; k <= n-4; k += 4) {
+            __m128i X = _mm_loadu_si128((const __m128i*)(sx + k));
+            __m128i Y = _mm_loadu_si128((const __m128i*)(sy + k));
+            __m128i w = _mm_add_epi32(_mm_slli_epi32(_mm_and_si128(Y, mask), INTER_BITS), _mm_and_si128(X, mask));
+            _mm_storeu_si128((__m128i*)(wofs + k), _mm_slli_epi32(w, 2));
+            _mm_storeu_si128((__m128i*)(sx + k), _mm_srai_epi32(X, INTER_BITS));
+            _mm_storeu_si128((__m128i*)(sy + k), _mm_srai_epi32(Y, INTER_BITS));
+        }
+    }
+#endif
 
-    result_ = refocused_host_.clone();
+    for ( ; k < n; k++) {
+        int X = sx[k], Y = sy[k];
+        wofs[k] = ((Y & (INTER_TAB_SIZE-1))*INTER_TAB_SIZE + (X & (INTER_TAB_SIZE-1)))*4;
+        sx[k] = X >> INTER_BITS;
+        sy[k] = Y >> INTER_BITS;
+    }
 
 }
 
-void saRefocus::CPUrefocus_ref_corner(int live, int frame) {
+// Samples columns xs to xe of output row y of a single channel view warped by
+// the inverse homography M into dst[0 .. xe-xs). Coordinates are generated
+// exactly like warp_perspective_rows and sampling matches remap with
+// INTER_LINEAR and BORDER_CONSTANT. Integer views (WT = int) are sampled with
+// fixed point weights and keep their native range.
+template<typename T, typename WT>
+static void warp_row(const Mat &src, const double* M, Size dsize, int y, int xs, int xe, const WT* wtab, WT* dst, int simd) {
+
+    const int BLOCK_SZ = 32;
+    int bh0 = std::min(BLOCK_SZ/2, dsize.height);
+    int bw0 = std::min(BLOCK_SZ*BLOCK_SZ/bh0, dsize.width);
+
+    const T* S = src.ptr<T>();
+    int step = src.step/sizeof(T);
+    int cols = src.cols, rows = src.rows;
+
+    int sxs[BLOCK_SZ*BLOCK_SZ], sys[BLOCK_SZ*BLOCK_SZ], wofs[BLOCK_SZ*BLOCK_SZ];
+
+    for (int x=(xs/bw0)*bw0; x<xe; x+=bw0) {
+
+        int bw = std::min(bw0, dsize.width-x);
+        int a = std::max(xs-x, 0), b = std::min(bw, xe-x);
+        warp_coords(M, x, y, a, b, sxs, sys, wofs, simd);
+        WT* d = dst + x + a - xs;
+
+        for (int k=0; k<b-a; k++) {
+            int sx = sxs[k], sy = sys[k];
+            const WT* w = wtab + wofs[k];
+
+            WT v;
+            if ((unsigned)sx < (unsigned)(cols-1) && (unsigned)sy < (unsigned)(rows-1)) {
+                const T* S0 = S + sy*step + sx;
+                v = bilinear_cast(S0[0]*w[0] + S0[1]*w[1] + S0[step]*w[2] + S0[step+1]*w[3]);
+            } else if (sx >= cols || sx+1 < 0 || sy >= rows || sy+1 < 0) {
+                v = 0;
+            } else {
+                bool x0 = sx >= 0, x1 = sx+1 < cols, y0 = sy >= 0, y1 = sy+1 < rows;
+                const T* S0 = S + sy*step + sx;
+                WT v0 = (y0 && x0) ? S0[0] : 0;
+                WT v1 = (y0 && x1) ? S0[1] : 0;
+                WT v2 = (y1 && x0) ? S0[step] : 0;
+                WT v3 = (y1 && x1) ? S0[step+1] : 0;
+                v = bilinear_cast(v0*w[0] + v1*w[1] + v2*w[2] + v3*w[3]);
+            }
+            d[k] = v;
+        }
 
-    Mat H;
-    calc_ref_refocus_H(0, H);
+    }
 
-    Mat res;
-    warpPerspective(imgs[0][frame], res, H, img_size_);
+}
 
-    if (mult_) {
-        pow(res, mult_exp_, cputemp2);
-    } else if (minlos_) {
-        cputemp2 = res.clone();
-    } else {
-        cputemp2 = res.clone()/double(num_cams_);
+// Builds the integral image of a grid of cell x cell blocks of img that marks
+// blocks containing at least one positive pixel
+static void build_occupancy(const Mat &img, int cell, Mat &occ_sum) {
+
+    Mat mask;
+    compare(img, Scalar(0), mask, CMP_GT);
+
+    Mat occ = Mat::zeros((img.rows+cell-1)/cell, (img.cols+cell-1)/cell, CV_8U);
+    for (int y=0; y<mask.rows; y++) {
+        const uchar* m = mask.ptr<uchar>(y);
+        uchar* o = occ.ptr<uchar>(y/cell);
+        for (int x=0; x<mask.cols; x++) {
+            if (m[x])
+                o[x/cell] = 1;
+        }
     }
 
-    refocused_host_ = cputemp2.clone();
-    
-    for (int i=1; i<num_cams_; i++) {
+    integral(occ, occ_sum, CV_32S);
 
-        calc_ref_refocus_H(i, H);
-        warpPerspective(imgs[i][frame], res, H, img_size_);
-        
-	if (mult_) {
-	    pow(res, mult_exp_, cputemp2);
-	    multiply(refocused_host_, cputemp2, refocused_host_);
-	} else if (minlos_) {
-	    min(refocused_host_,res,refocused_host_);
-	} else {
-            refocused_host_ += res.clone()/double(num_cams_);
-	}
+}
+
+// Checks if output pixels in [x0, x1) x [y0, y1) can sample any positive pixel
+// of a view with occupancy integral occ_sum through the inverse homography M
+static bool rect_reachable(const Mat &occ_sum, int cell, Size src_size, const double* M, int x0, int y0, int x1, int y1) {
+
+    double xs[4] = {x0, x1-1, x0, x1-1};
+    double ys[4] = {y0, y0, y1-1, y1-1};
+
+    double minx = DBL_MAX, miny = DBL_MAX, maxx = -DBL_MAX, maxy = -DBL_MAX;
+    for (int c=0; c<4; c++) {
+        double W = M[6]*xs[c] + M[7]*ys[c] + M[8];
+        // Rectangle is not mapped to a bounded quadrilateral
+        if (W <= 0)
+            return true;
+        double sx = (M[0]*xs[c] + M[1]*ys[c] + M[2])/W;
+        double sy = (M[3]*xs[c] + M[4]*ys[c] + M[5])/W;
+        minx = std::min(minx, sx); maxx = std::max(maxx, sx);
+        miny = std::min(miny, sy); maxy = std::max(maxy, sy);
     }
 
-    // TODO: thresholding missing?
+    // Bilinear taps plus a pixel of margin for fixed point rounding
+    if (maxx < -2 || maxy < -2 || minx > src_size.width || miny > src_size.height)
+        return false;
+    int cx0 = std::max(0.0, floor(minx) - 1);
+    int cy0 = std::max(0.0, floor(miny) - 1);
+    int cx1 = std::min(src_size.width-1.0, floor(maxx) + 2);
+    int cy1 = std::min(src_size.height-1.0, floor(maxy) + 2);
 
-    if (live)
-        liveViewWindow(refocused_host_);
+    cx0 /= cell; cy0 /= cell; cx1 = cx1/cell + 1; cy1 = cy1/cell + 1;
+    int count = occ_sum.at<int>(cy1, cx1) - occ_sum.at<int>(cy0, cx1) - occ_sum.at<int>(cy1, cx0) + occ_sum.at<int>(cy0, cx0);
 
-    result_ = refocused_host_.clone();
+    return count > 0;
 
 }
 
-// ---CPU Refocusing Functions End--- //
+// Narrows [lo, hi] to the x where c*x + d > 0
+static inline void clip_halfline(double c, double d, double &lo, double &hi) {
 
-void saRefocus::calc_ref_refocus_map(Mat_<double> Xcam, double z, Mat_<double> &x, Mat_<double> &y, int cam) {
+    if (c > 0)
+        lo = std::max(lo, -d/c);
+    else if (c < 0)
+        hi = std::min(hi, -d/c);
+    else if (d <= 0)
+        hi = lo - 1;
 
-    int width = img_size_.width;
-    int height = img_size_.height;
+}
 
-    Mat_<double> D = Mat_<double>::zeros(3,3);
-    D(0,0) = scale_; D(1,1) = scale_;
-    D(0,2) = width*0.5;
-    D(1,2) = height*0.5;
-    D(2,2) = 1;
-    Mat hinv = D.inv();
+// Calculates the columns [xa, xb) of output row y within [x0, x1) that the
+// inverse homography M maps into the footprint of a view of size src_size.
+// Each footprint edge is a linear inequality along the row so the columns
+// form one interval. A margin of a pixel keeps every column with a non zero
+// bilinear sample.
+static void row_footprint(const double* M, Size src_size, int y, int x0, int x1, int &xa, int &xb) {
 
-    Mat_<double> X = Mat_<double>::zeros(3, height*width);
-    for (int i=0; i<width; i++) {
-        for (int j=0; j<height; j++) {
-            X(0,i*height+j) = i;
-            X(1,i*height+j) = j;
-            X(2,i*height+j) = 1;
-        }
+    double X0 = M[1]*y + M[2], Y0 = M[4]*y + M[5], W0 = M[7]*y + M[8];
+
+    // Rows that cross the horizon of the homography are sampled in full
+    if (W0 + M[6]*x0 <= 0 || W0 + M[6]*(x1-1) <= 0) {
+        xa = x0; xb = x1;
+        return;
     }
-    X = hinv*X;
 
-    for (int i=0; i<X.cols; i++)
-        X(2,i) = z;
+    // With W > 0, -2 < X/W < cols+1 is -2W < X < (cols+1)W and similarly
+    // for Y
+    double lo = x0, hi = x1-1;
+    double w = src_size.width + 1, h = src_size.height + 1;
+    clip_halfline(M[0] + 2*M[6], X0 + 2*W0, lo, hi);
+    clip_halfline(w*M[6] - M[0], w*W0 - X0, lo, hi);
+    clip_halfline(M[3] + 2*M[6], Y0 + 2*W0, lo, hi);
+    clip_halfline(h*M[6] - M[3], h*W0 - Y0, lo, hi);
+
+    if (lo > hi) {
+        xa = xb = x0;
+        return;
+    }
+    xa = std::max(x0, int(floor(lo)) - 1);
+    xb = std::min(x1, int(ceil(hi)) + 2);
 
-    //cout<<"Refracting points"<<endl;
-    Mat_<double> X_out = Mat_<double>::zeros(4, height*width);
-    img_refrac(Xcam, X, X_out);
+}
 
-    //cout<<"Projecting to find final map"<<endl;
-    Mat_<double> proj = P_mats_[cam]*X_out;
-    for (int i=0; i<width; i++) {
-        for (int j=0; j<height; j++) {
-            int ind = i*height+j; // TODO: check this indexing
-            proj(0,ind) /= proj(2,ind);
-            proj(1,ind) /= proj(2,ind);
-            x(j,i) = proj(0,ind);
-            y(j,i) = proj(1,ind);
+enum { COMBINE_ADD, COMBINE_MULT, COMBINE_MIN };
+
+#if defined REFOCUS_AVX
+static AVX_TARGET int combine_row_avx(float* acc, const float* buf, int n, int op, int first, float fact, int thresholding, float thresh) {
+
+    int x = 0;
+    __m256 f8 = _mm256_set1_ps(fact), t8 = _mm256_set1_ps(thresh);
+    for ( ; x <= n-8; x += 8) {
+        __m256 v = _mm256_loadu_ps(buf + x);
+        if (op == COMBINE_ADD) {
+            v = _mm256_mul_ps(v, f8);
+            if (!first) v = _mm256_add_ps(_mm256_loadu_ps(acc + x), v);
+        } else if (op == COMBINE_MULT) {
+            if (!first) v = _mm256_mul_ps(_mm256_loadu_ps(acc + x), v);
+        } else {
+            if (!first) v = _mm256_min_ps(_mm256_loadu_ps(acc + x), v);
         }
+        if (thresholding)
+            v = _mm256_and_ps(v, _mm256_cmp_ps(v, t8, _CMP_GT_OQ));
+        _mm256_storeu_ps(acc + x, v);
     }
 
+    return x;
+
 }
+#endif
 
-void saRefocus::calc_refocus_map(Mat_<double> &x, Mat_<double> &y, int cam) {
+// Combines one warped row buf into accumulator row acc. The first camera
+// initializes acc and the last one optionally applies THRESH_TOZERO.
+static void combine_row(float* acc, const float* buf, int n, int op, int first, float fact, int thresholding, float thresh, int simd) {
 
-    int width = img_size_.width;
-    int height = img_size_.height;
+    int x = 0;
 
-    Mat_<double> D = Mat_<double>::zeros(3,3);
-    D(0,0) = scale_; D(1,1) = scale_;
-    D(0,2) = width*0.5;
-    D(1,2) = height*0.5;
-    D(2,2) = 1;
-    Mat hinv = D.inv();
+#if defined REFOCUS_AVX
+    if (simd > 1)
+        x = combine_row_avx(acc, buf, n, op, first, fact, thresholding, thresh);
+#endif
 
-    Mat_<double> X = Mat_<double>::zeros(3, height*width);
-    for (int i=0; i<width; i++) {
-        for (int j=0; j<height; j++) {
-            X(0,i*height+j) = i;
+#if defined __SSE2__
+    if (simd > 0) {
+        __m128 f4 = _mm_set1_ps(fact), t4 = _mm_set1_ps(thresh);
+        for ( ; x <= n-4; x += 4) {
+            __m128 v = _mm_loadu_ps(buf + x);
+            if (op == COMBINE_ADD) {
+                v = _mm_mul_ps(v, f4);
+                if (!first) v = _mm_add_ps(_mm_loadu_ps(acc + x), v);
+            } else if (op == COMBINE_MULT) {
+                if (!first) v = _mm_mul_ps(_mm_loadu_ps(acc + x), v);
+            } else {
+                if (!first) v = _mm_min_ps(_mm_loadu_ps(acc + x), v);
+            }
+            if (thresholding)
+                v = _mm_and_ps(v, _mm_cmpgt_ps(v, t4));
+            _mm_storeu_ps(acc + x, v);
+        }
+    }
+#endif
+
+    for ( ; x < n; x++) {
+        float v = buf[x];
+        if (op == COMBINE_ADD) {
+            v *= fact;
+            if (!first) v = acc[x] + v;
+        } else if (op == COMBINE_MULT) {
+            if (!first) v = acc[x]*v;
+        } else {
+            if (!first) v = std::min(acc[x], v);
+        }
+        if (thresholding && !(v > thresh))
+            v = 0;
+        acc[x] = v;
+    }
+
+}
+
+// Integer version of combine_row for additive and minimum line of sight
+// refocusing of integer images
+static void combine_row_int(int* acc, const int* buf, int n, int op, int first, int simd) {
+
+    int x = 0;
+
+    if (first) {
+        memcpy(acc, buf, n*sizeof(int));
+        return;
+    }
+
+#if defined __SSE2__
+    if (simd > 0 && op == COMBINE_ADD) {
+        for ( ; x <= n-4; x += 4) {
+            __m128i v = _mm_loadu_si128((const __m128i*)(buf + x));
+            v = _mm_add_epi32(_mm_loadu_si128((const __m128i*)(acc + x)), v);
+            _mm_storeu_si128((__m128i*)(acc + x), v);
+        }
+    }
+#endif
+
+    for ( ; x < n; x++) {
+        if (op == COMBINE_ADD)
+            acc[x] += buf[x];
+        else
+            acc[x] = std::min(acc[x], buf[x]);
+    }
+
+}
+
+// Scales an integer accumulator row into the float output row and optionally
+// applies THRESH_TOZERO
+static void finalize_row_int(float* out, const int* acc, int n, float scale, int thresholding, float thresh, int simd) {
+
+    int x = 0;
+
+#if defined __SSE2__
+    if (simd > 0) {
+        __m128 s4 = _mm_set1_ps(scale), t4 = _mm_set1_ps(thresh);
+        for ( ; x <= n-4; x += 4) {
+            __m128 v = _mm_mul_ps(_mm_cvtepi32_ps(_mm_loadu_si128((const __m128i*)(acc + x))), s4);
+            if (thresholding)
+                v = _mm_and_ps(v, _mm_cmpgt_ps(v, t4));
+            _mm_storeu_ps(out + x, v);
+        }
+    }
+#endif
+
+    for ( ; x < n; x++) {
+        float v = acc[x]*scale;
+        if (thresholding && !(v > thresh))
+            v = 0;
+        out[x] = v;
+    }
+
+}
+
+// Divides an accumulator row by the number of cameras that cover each pixel,
+// scales it into the float output row and optionally applies THRESH_TOZERO.
+// inv_cnt holds 1/c for every possible count c.
+template<typename WT>
+static void normalize_row(float* out, const WT* acc, const int* cnt, int n, float scale, const float* inv_cnt, int thresholding, float thresh) {
+
+    for (int x=0; x<n; x++) {
+        float v = acc[x]*scale*inv_cnt[cnt[x]];
+        if (thresholding && !(v > thresh))
+            v = 0;
+        out[x] = v;
+    }
+
+}
+
+static inline void finalize_row(float* out, const float* acc, int n, float scale, int thresholding, float thresh, int simd) {
+    combine_row(out, acc, n, COMBINE_ADD, 1, scale, thresholding, thresh, simd);
+}
+
+static inline void finalize_row(float* out, const int* acc, int n, float scale, int thresholding, float thresh, int simd) {
+    finalize_row_int(out, acc, n, scale, thresholding, thresh, simd);
+}
+
+static inline void add_row(float* acc, const float* buf, int n, int simd) {
+    combine_row(acc, buf, n, COMBINE_ADD, 0, 1, 0, 0, simd);
+}
+
+static inline void add_row(int* acc, const int* buf, int n, int simd) {
+    combine_row_int(acc, buf, n, COMBINE_ADD, 0, simd);
+}
+
+// Scales samples by fact before they are added to an accumulator, which
+// rounds exactly like combine_row. Integer sums are exact and are scaled once
+// when the row is finalized instead.
+static inline void scale_row(float* v, int n, float fact) {
+    for (int x=0; x<n; x++)
+        v[x] *= fact;
+}
+
+static inline void scale_row(int* v, int n, float fact) {}
+
+// Clips samples to 1 for NLCA. Integer samples never exceed their maximum.
+static inline void clip_row(float* v, int n) {
+    for (int x=0; x<n; x++)
+        v[x] = std::min(v[x], 1.f);
+}
+
+static inline void clip_row(int* v, int n) {}
+
+/*!
+  Parallel body that calculates row tiles of one or more refocused planes. Jobs
+  are numbered plane by plane so that a whole volume can be handed to a single
+  parallel_for_ call. Float images go through a fused kernel that, for every
+  output row, samples each camera into a small row buffer and combines it into
+  the output row (SIMD when available) so each output pixel is only written
+  from cache. 8 and 16 bit images are sampled with fixed point weights and
+  accumulated in integers (except for multiplicative refocusing) and are only
+  converted to float, scaled to [0, 1], when written to the output. Other types
+  fall back to per tile OpenCV calls. With clip set (NLCA) float samples are
+  clipped to 1 before they are averaged. Averages only sample each camera in
+  the part of a row its footprint covers and can optionally be normalized by
+  the number of cameras covering each pixel instead of all cameras. When statistics are collected, the
+  mean and variance of every job's output are accumulated while its rows are
+  still in cache so that thresholding relative to them needs no extra pass
+  over the data. In sparse mode
+  (multiplicative or minimum line of sight only) blocks of output that some
+  camera cannot see any positive pixel from are set to zero without sampling.
+*/
+class refocusInvoker : public ParallelLoopBody {
+
+ public:
+
+    refocusInvoker(const vector<Mat> &views, const vector< vector<Mat> > &Ms, const vector<Mat> &planes, int tile_rows, int mult, double mult_exp, int minlos, int clip, int thresholding, double thresh, const vector<Mat> &occ_sums, int cell):
+        views_(views), Ms_(Ms), planes_(planes), tile_rows_(tile_rows), mult_(mult), mult_exp_(mult_exp), minlos_(minlos), clip_(clip), thresholding_(thresholding), thresh_(thresh), occ_sums_(occ_sums), cell_(cell) {
+
+        num_tiles_ = (planes_[0].rows + tile_rows_ - 1)/tile_rows_;
+
+        int vtype = views_[0].type();
+        fused_ = planes_[0].type() == CV_32FC1 && (vtype == CV_32FC1 || vtype == CV_8UC1 || vtype == CV_16UC1);
+        init_bilinear_tab(wtab_);
+        init_bilinear_tab_int(wtab_, iwtab_);
+
+        // Skipping unreachable regions is only valid when a zero from any
+        // camera zeros the output
+        sparse_ = fused_ && occ_sums_.size() == views_.size() && ((mult_ && mult_exp_ > 0) || minlos_);
+
+        simd_ = 0;
+        if (checkHardwareSupport(CV_CPU_SSE2))
+            simd_ = 1;
+        if (checkHardwareSupport(CV_CPU_AVX))
+            simd_ = 2;
+
+        stats_ = NULL;
+        norm_ = 0;
+
+    }
+
+    int num_jobs() const { return num_tiles_*planes_.size(); }
+    int num_tiles() const { return num_tiles_; }
+
+    //! Average pixels over the cameras that cover them (fused kernel only)
+    void normalizeOverlap(int flag) { norm_ = flag; }
+
+    //! Collect statistics of the output of each job (before thresholding)
+    void collectStats(vector<runningStats> &stats) {
+        stats.assign(num_jobs(), runningStats());
+        stats_ = &stats;
+    }
+
+    virtual void operator() (const Range &range) const {
+
+        for (int job=range.start; job<range.end; job++) {
+
+            int p = job/num_tiles_;
+            int r0 = (job%num_tiles_)*tile_rows_;
+            int r1 = std::min(r0+tile_rows_, planes_[p].rows);
+
+            runningStats* st = stats_ ? &(*stats_)[job] : NULL;
+            if (fused_)
+                fused_tile(p, r0, r1, st);
+            else
+                tile(p, r0, r1, st);
+
+        }
+
+    }
+
+ private:
+
+    void fused_tile(int p, int r0, int r1, runningStats* st) const {
+
+        int width = planes_[p].cols;
+
+        if (!sparse_) {
+            fused_rect(p, r0, r1, 0, width, st);
+            return;
+        }
+
+        // Split the row tile into blocks and only calculate blocks that every
+        // camera sees a positive pixel in
+        const int cols = 64;
+        for (int x0=0; x0<width; x0+=cols) {
+            int x1 = std::min(x0+cols, width);
+            bool reachable = true;
+            for (int i=0; i<views_.size() && reachable; i++)
+                reachable = rect_reachable(occ_sums_[i], cell_, views_[i].size(), Ms_[p][i].ptr<double>(), x0, r0, x1, r1);
+            if (reachable) {
+                fused_rect(p, r0, r1, x0, x1, st);
+            } else {
+                planes_[p](Range(r0, r1), Range(x0, x1)).setTo(Scalar(0));
+                if (st)
+                    st->add(0, (r1-r0)*(x1-x0));
+            }
+        }
+
+    }
+
+    void fused_rect(int p, int r0, int r1, int x0, int x1, runningStats* st) const {
+
+        if (!mult_ && !minlos_) {
+            switch (views_[0].depth()) {
+            case CV_8U:
+                fused_rect_add<uchar, int>(p, r0, r1, x0, x1, &iwtab_[0], 1/255.0, st);
+                return;
+            case CV_16U:
+                fused_rect_add<ushort, int>(p, r0, r1, x0, x1, &iwtab_[0], 1/65535.0, st);
+                return;
+            default:
+                fused_rect_add<float, float>(p, r0, r1, x0, x1, &wtab_[0], 1, st);
+                return;
+            }
+        }
+
+        switch (views_[0].depth()) {
+        case CV_8U:
+            fused_rect_int<uchar>(p, r0, r1, x0, x1, 1/255.0, st);
+            return;
+        case CV_16U:
+            fused_rect_int<ushort>(p, r0, r1, x0, x1, 1/65535.0, st);
+            return;
+        }
+
+        int n = views_.size();
+        int op = mult_ ? COMBINE_MULT : (minlos_ ? COMBINE_MIN : COMBINE_ADD);
+        float fact = 1/double(n);
+
+        vector<float> buf(x1-x0);
+        Mat bufm(1, x1-x0, CV_32F, &buf[0]);
+        Mat plane = planes_[p];
+
+        for (int y=r0; y<r1; y++) {
+            float* acc = plane.ptr<float>(y) + x0;
+            for (int i=0; i<n; i++) {
+                warp_row<float, float>(views_[i], Ms_[p][i].ptr<double>(), planes_[p].size(), y, x0, x1, &wtab_[0], &buf[0], simd_);
+                if (mult_)
+                    pow(bufm, mult_exp_, bufm);
+                combine_row(acc, &buf[0], x1-x0, op, i==0, fact, thresholding_ && i==n-1, (float)thresh_, simd_);
+            }
+            if (st)
+                st->add(acc, x1-x0);
+        }
+
+    }
+
+    // Additive refocusing and NLCA averages. WT is the type samples are
+    // accumulated in and scale converts the sum to [0, 1].
+    template<typename T, typename WT>
+    void fused_rect_add(int p, int r0, int r1, int x0, int x1, const WT* wtab, double scale, runningStats* st) const {
+
+        int n = views_.size();
+        int w = x1-x0;
+
+        vector<WT> buf(w), acc(w);
+        vector<int> cnt(w);
+        vector<float> inv_cnt(n+1, 0);
+        for (int c=1; c<=n; c++)
+            inv_cnt[c] = 1.0/c;
+        Mat plane = planes_[p];
+
+        // Without overlap normalization float samples are scaled by 1/n per
+        // camera so the output is bitwise the same as the unfused kernel
+        bool int_sum = std::numeric_limits<WT>::is_integer;
+        float fact = 1/double(n);
+
+        for (int y=r0; y<r1; y++) {
+
+            float* out = plane.ptr<float>(y) + x0;
+            std::fill(acc.begin(), acc.end(), WT(0));
+            if (norm_)
+                std::fill(cnt.begin(), cnt.end(), 0);
+
+            // Cameras contribute nothing outside their footprint
+            for (int i=0; i<n; i++) {
+                const double* M = Ms_[p][i].ptr<double>();
+                int xa, xb;
+                row_footprint(M, views_[i].size(), y, x0, x1, xa, xb);
+                if (xa >= xb)
+                    continue;
+                warp_row<T, WT>(views_[i], M, planes_[p].size(), y, xa, xb, wtab, &buf[0], simd_);
+                if (clip_)
+                    clip_row(&buf[0], xb-xa);
+                if (!norm_)
+                    scale_row(&buf[0], xb-xa, fact);
+                add_row(&acc[xa-x0], &buf[0], xb-xa, simd_);
+                if (norm_)
+                    for (int x=xa-x0; x<xb-x0; x++)
+                        cnt[x]++;
+            }
+
+            if (norm_)
+                normalize_row(out, &acc[0], &cnt[0], w, scale, &inv_cnt[0], thresholding_, (float)thresh_);
+            else
+                finalize_row(out, &acc[0], w, int_sum ? scale/n : scale, thresholding_, (float)thresh_, simd_);
+            if (st)
+                st->add(out, w);
+
+        }
+
+    }
+
+    template<typename T>
+    void fused_rect_int(int p, int r0, int r1, int x0, int x1, double inv_max, runningStats* st) const {
+
+        int n = views_.size();
+        int w = x1-x0;
+
+        vector<int> buf(w), acc(w);
+        vector<float> fbuf(w);
+        Mat fbufm(1, w, CV_32F, &fbuf[0]);
+        Mat plane = planes_[p];
+
+        for (int y=r0; y<r1; y++) {
+            float* out = plane.ptr<float>(y) + x0;
+            for (int i=0; i<n; i++) {
+                warp_row<T, int>(views_[i], Ms_[p][i].ptr<double>(), planes_[p].size(), y, x0, x1, &iwtab_[0], &buf[0], simd_);
+                if (mult_) {
+                    // Products of many integer samples overflow so these
+                    // are combined in float
+                    for (int x=0; x<w; x++)
+                        fbuf[x] = buf[x]*inv_max;
+                    pow(fbufm, mult_exp_, fbufm);
+                    combine_row(out, &fbuf[0], w, COMBINE_MULT, i==0, 1, thresholding_ && i==n-1, (float)thresh_, simd_);
+                } else {
+                    combine_row_int(&acc[0], &buf[0], w, minlos_ ? COMBINE_MIN : COMBINE_ADD, i==0, simd_);
+                }
+            }
+            if (!mult_)
+                finalize_row_int(out, &acc[0], w, minlos_ ? inv_max : inv_max/n, thresholding_, (float)thresh_, simd_);
+            if (st)
+                st->add(out, w);
+        }
+
+    }
+
+    void tile(int p, int r0, int r1, runningStats* st) const {
+
+        Scalar fact = Scalar(1/double(views_.size()));
+        Mat xy, alpha, warped, warped2;
+        Mat tile = planes_[p].rowRange(r0, r1);
+
+        for (int i=0; i<views_.size(); i++) {
+
+            warp_perspective_rows(views_[i], warped, Ms_[p][i].ptr<double>(), planes_[p].size(), r0, r1, xy, alpha);
+
+            if (mult_) {
+                pow(warped, mult_exp_, warped2);
+                if (i>0)
+                    multiply(tile, warped2, tile);
+                else
+                    warped2.copyTo(tile);
+            } else if (minlos_) {
+                if (i>0)
+                    min(warped, tile, tile);
+                else
+                    warped.copyTo(tile);
+            } else {
+                if (clip_)
+                    min(warped, 1.0, warped);
+                multiply(warped, fact, warped2);
+                if (i>0)
+                    add(tile, warped2, tile);
+                else
+                    warped2.copyTo(tile);
+            }
+
+        }
+
+        if (st)
+            for (int y=0; y<tile.rows; y++)
+                st->add(tile.ptr<float>(y), tile.cols);
+
+        if (thresholding_)
+            threshold(tile, tile, thresh_, 0, THRESH_TOZERO);
+
+    }
+
+    const vector<Mat> &views_;
+    const vector< vector<Mat> > &Ms_;
+    const vector<Mat> &planes_;
+    int num_tiles_;
+    int tile_rows_;
+    int mult_;
+    double mult_exp_;
+    int minlos_;
+    int clip_;
+    int thresholding_;
+    double thresh_;
+    const vector<Mat> &occ_sums_;
+    int cell_;
+    int fused_;
+    int sparse_;
+    int simd_;
+    vector<float> wtab_;
+    vector<int> iwtab_;
+    vector<runningStats>* stats_;
+    int norm_;
+
+};
+
+// Sliding maximum of n values over a window of w values centered on each
+// value (van Herk / Gil-Werman), ignoring values outside
+// the array. g and h are buffers of at least n+w-1 values. Takes three
+// comparisons per value regardless of w.
+static void sliding_max(const float* src, float* dst, int n, int w, float* g, float* h) {
+
+    int r = w/2;
+    int len = n + w - 1;
+
+    // The array, padded with r values in front, is split into blocks of w
+    // values. g is the running max from the start of each block and h the
+    // running max to its end so that any window, which spans at most two
+    // blocks, is the max of one h and one g value.
+    for (int j=0; j<len; j++) {
+        int i = j - r;
+        float v = (i >= 0 && i < n) ? src[i] : -FLT_MAX;
+        g[j] = (j % w == 0) ? v : std::max(g[j-1], v);
+    }
+    for (int j=len-1; j>=0; j--) {
+        int i = j - r;
+        float v = (i >= 0 && i < n) ? src[i] : -FLT_MAX;
+        h[j] = (j % w == w-1 || j == len-1) ? v : std::max(h[j+1], v);
+    }
+
+    for (int i=0; i<n; i++)
+        dst[i] = std::max(h[i], g[i+w-1]);
+
+}
+
+/*!
+  Parallel body that turns planes holding the average of clipped camera
+  samples into NLCA images exp(-0.5*((mean - ref)/delta)^2). Fast NLCA uses
+  ref = 1 and NLCA the maximum average in a window x window neighborhood of
+  each pixel. The maximum is separable, so pass 0 (jobs are row tiles) takes
+  the sliding max along rows into rowmax and pass 1 (jobs are column bands)
+  takes the sliding max of rowmax along columns and writes the NLCA values.
+  Both passes cost the same per pixel for any window size.
+*/
+class nlcaInvoker : public ParallelLoopBody {
+
+ public:
+
+    nlcaInvoker(const vector<Mat> &planes, const vector<Mat> &rowmax, int window, double delta):
+        planes_(planes), rowmax_(rowmax), window_(window), delta_(delta), pass_(0) {
+
+        rows_ = planes_[0].rows;
+        cols_ = planes_[0].cols;
+        tile_rows_ = 16;
+        band_cols_ = 64;
+
+    }
+
+    void setPass(int pass) { pass_ = pass; }
+
+    int num_jobs() const {
+        if (pass_ == 0)
+            return planes_.size()*((rows_ + tile_rows_ - 1)/tile_rows_);
+        return planes_.size()*((cols_ + band_cols_ - 1)/band_cols_);
+    }
+
+    virtual void operator() (const Range &range) const {
+
+        for (int job=range.start; job<range.end; job++) {
+            if (pass_ == 0) {
+                int tiles = (rows_ + tile_rows_ - 1)/tile_rows_;
+                int r0 = (job%tiles)*tile_rows_;
+                row_tile(job/tiles, r0, std::min(r0+tile_rows_, rows_));
+            } else {
+                int bands = (cols_ + band_cols_ - 1)/band_cols_;
+                int c0 = (job%bands)*band_cols_;
+                column_band(job/bands, c0, std::min(c0+band_cols_, cols_));
+            }
+        }
+
+    }
+
+ private:
+
+    void row_tile(int p, int r0, int r1) const {
+
+        vector<float> g(cols_+window_), h(cols_+window_);
+        Mat rowmax = rowmax_[p];
+        for (int y=r0; y<r1; y++)
+            sliding_max(planes_[p].ptr<float>(y), rowmax.ptr<float>(y), cols_, window_, &g[0], &h[0]);
+
+    }
+
+    void column_band(int p, int c0, int c1) const {
+
+        int w = c1-c0;
+        vector<float> ref(rows_*w), g, h;
+
+        if (window_) {
+            // Columns of the band are copied next to each other so that
+            // the column max runs on contiguous memory
+            vector<float> col(rows_*w);
+            for (int y=0; y<rows_; y++) {
+                const float* m = rowmax_[p].ptr<float>(y) + c0;
+                for (int x=0; x<w; x++)
+                    col[x*rows_+y] = m[x];
+            }
+            g.resize(rows_+window_); h.resize(rows_+window_);
+            for (int x=0; x<w; x++)
+                sliding_max(&col[x*rows_], &ref[x*rows_], rows_, window_, &g[0], &h[0]);
+        } else {
+            std::fill(ref.begin(), ref.end(), 1.f);
+        }
+
+        vector<float> buf(w);
+        Mat bufm(1, w, CV_32F, &buf[0]);
+        float s = 1/delta_;
+        Mat plane = planes_[p];
+        for (int y=0; y<rows_; y++) {
+            float* v = plane.ptr<float>(y) + c0;
+            for (int x=0; x<w; x++) {
+                float d = (v[x] - ref[x*rows_+y])*s;
+                buf[x] = -0.5f*d*d;
+            }
+            Mat out(1, w, CV_32F, v);
+            exp(bufm, out);
+        }
+
+    }
+
+    const vector<Mat> &planes_;
+    const vector<Mat> &rowmax_;
+    int window_;
+    double delta_;
+    int pass_;
+    int rows_;
+    int cols_;
+    int tile_rows_;
+    int band_cols_;
+
+};
+
+// Samples row pair r0, r1 of an image of width src_cols shifted by ix whole
+// pixels with constant bilinear weights w into dst[0 .. cols), with zeros
+// outside the image
+static void shift_row(const float* r0, const float* r1, int cols, int src_cols, int ix, const float* w, float* dst, int simd) {
+
+    // Columns whose two taps are both inside the source row
+    int xa = std::min(cols, std::max(0, -ix));
+    int xb = std::max(xa, std::min(cols, src_cols-1-ix));
+
+    for (int x=0; x<cols; x++) {
+        if (x == xa)
+            x = xb;
+        if (x >= cols)
+            break;
+        int xs = x + ix;
+        float v = 0;
+        if (xs >= 0 && xs < src_cols)
+            v += w[0]*r0[xs] + w[2]*r1[xs];
+        if (xs+1 >= 0 && xs+1 < src_cols)
+            v += w[1]*r0[xs+1] + w[3]*r1[xs+1];
+        dst[x] = v;
+    }
+
+    const float* a = r0 + ix;
+    const float* b = r1 + ix;
+    int x = xa;
+
+#if defined __SSE2__
+    if (simd > 0) {
+        __m128 w0 = _mm_set1_ps(w[0]), w1 = _mm_set1_ps(w[1]), w2 = _mm_set1_ps(w[2]), w3 = _mm_set1_ps(w[3]);
+        for ( ; x <= xb-4; x += 4) {
+            __m128 v = _mm_add_ps(_mm_mul_ps(w0, _mm_loadu_ps(a + x)), _mm_mul_ps(w1, _mm_loadu_ps(a + x + 1)));
+            v = _mm_add_ps(v, _mm_mul_ps(w2, _mm_loadu_ps(b + x)));
+            v = _mm_add_ps(v, _mm_mul_ps(w3, _mm_loadu_ps(b + x + 1)));
+            _mm_storeu_ps(dst + x, v);
+        }
+    }
+#endif
+
+    for ( ; x < xb; x++)
+        dst[x] = w[0]*a[x] + w[1]*a[x+1] + w[2]*b[x] + w[3]*b[x+1];
+
+}
+
+/*!
+  Parallel body for incremental refocusing that combines warped images of each
+  camera, each shifted by a constant sub pixel offset, into a refocused image.
+  Shifts only need streaming bilinear interpolation with weights that are the
+  same for the whole image, which is much cheaper than warping. Warps extend
+  margin pixels beyond the refocused image on every side. Jobs are rows.
+*/
+class shiftInvoker : public ParallelLoopBody {
+
+ public:
+
+    shiftInvoker(const vector<Mat> &warps, int margin, const vector<Point2d> &shifts, const Mat &out, int mult, double mult_exp, int minlos, int clip, int thresholding, double thresh):
+        warps_(warps), out_(out), mult_(mult), mult_exp_(mult_exp), minlos_(minlos), clip_(clip), thresholding_(thresholding), thresh_(thresh) {
+
+        for (int i=0; i<shifts.size(); i++) {
+            double fx = floor(shifts[i].x), fy = floor(shifts[i].y);
+            double ax = shifts[i].x - fx, ay = shifts[i].y - fy;
+            ix_.push_back(fx + margin); iy_.push_back(fy + margin);
+            w_.push_back((1-ax)*(1-ay)); w_.push_back(ax*(1-ay));
+            w_.push_back((1-ax)*ay); w_.push_back(ax*ay);
+        }
+        zeros_.assign(warps_.empty() ? 0 : warps_[0].cols, 0.f);
+
+        simd_ = 0;
+        if (checkHardwareSupport(CV_CPU_SSE2))
+            simd_ = 1;
+        if (checkHardwareSupport(CV_CPU_AVX))
+            simd_ = 2;
+
+    }
+
+    virtual void operator() (const Range &range) const {
+
+        int n = warps_.size();
+        int cols = out_.cols;
+        int op = mult_ ? COMBINE_MULT : (minlos_ ? COMBINE_MIN : COMBINE_ADD);
+        float fact = 1/double(n);
+
+        vector<float> buf(cols);
+        Mat bufm(1, cols, CV_32F, &buf[0]);
+        Mat out = out_;
+
+        for (int y=range.start; y<range.end; y++) {
+            float* acc = out.ptr<float>(y);
+            for (int i=0; i<n; i++) {
+                int y0 = y + iy_[i], rows = warps_[i].rows;
+                const float* r0 = (y0 >= 0 && y0 < rows) ? warps_[i].ptr<float>(y0) : &zeros_[0];
+                const float* r1 = (y0+1 >= 0 && y0+1 < rows) ? warps_[i].ptr<float>(y0+1) : &zeros_[0];
+                shift_row(r0, r1, cols, warps_[i].cols, ix_[i], &w_[4*i], &buf[0], simd_);
+                if (mult_)
+                    pow(bufm, mult_exp_, bufm);
+                else if (clip_)
+                    clip_row(&buf[0], cols);
+                combine_row(acc, &buf[0], cols, op, i==0, fact, thresholding_ && i==n-1, (float)thresh_, simd_);
+            }
+        }
+
+    }
+
+ private:
+
+    const vector<Mat> &warps_;
+    Mat out_;
+    vector<int> ix_, iy_;
+    vector<float> w_;
+    vector<float> zeros_;
+    int mult_;
+    double mult_exp_;
+    int minlos_;
+    int clip_;
+    int thresholding_;
+    double thresh_;
+    int simd_;
+
+};
+
+// Calculates the inverse homographies (destination to source, which is
+// what the tiles need) of all cameras for the current focal plane
+void saRefocus::calc_inverse_Hs(vector<Mat> &Ms) {
+
+    Ms.resize(num_cams_);
+
+    if (!REF_FLAG) {
+        build_homography_sweep();
+        for (int i=0; i<num_cams_; i++)
+            calc_refocus_H_inv(i, z_, Ms[i]);
+    } else {
+        Mat H;
+        for (int i=0; i<num_cams_; i++) {
+            calc_ref_refocus_H(i, H);
+            H.convertTo(Ms[i], CV_64F);
+            invert(Ms[i], Ms[i]);
+        }
+    }
+
+    // Output pixels are relative to the region of interest
+    if (roi_.area()) {
+        Mat T = (Mat_<double>(3,3) << 1, 0, roi_.x, 0, 1, roi_.y, 0, 0, 1);
+        for (int i=0; i<num_cams_; i++)
+            Ms[i] = Ms[i]*T;
+    }
+
+    scale_to_level(Ms);
+
+}
+
+// Calculates refocused planes using the inverse homographies Ms (one vector
+// per plane with one matrix per camera) by splitting all planes into row
+// tiles over all CPU threads
+void saRefocus::CPUrefocus_tiles(vector< vector<Mat> > &Ms, int frame, vector<Mat> &planes, int thresholding) {
+
+    vector<Mat> views;
+    for (int i=0; i<num_cams_; i++)
+        views.push_back(get_view(i, frame));
+
+    vector<Mat> occ_sums;
+    const int cell = 16;
+    if (SPARSE_FLAG) {
+        if (mult_ || minlos_) {
+            occ_sums.resize(num_cams_);
+            for (int i=0; i<num_cams_; i++)
+                build_occupancy(views[i], cell, occ_sums[i]);
+        } else {
+            LOG_FIRST_N(WARNING, 1) << "Sparse refocusing only applies to multiplicative and minimum line of sight refocusing. Refocusing all pixels.";
+        }
+    }
+
+    // Thresholds relative to the standard deviation are applied once all
+    // tiles and their statistics are done
+    int nlca = nlca_ || nlca_fast_;
+    int stdev = thresholding && !nlca && STDEV_THRESH;
+    refocusInvoker body(views, Ms, planes, tile_rows_, mult_, mult_exp_, minlos_, nlca, thresholding && !nlca && !stdev, thresh_, occ_sums, cell);
+
+    body.normalizeOverlap(OVERLAP_NORM_FLAG);
+
+    vector<runningStats> stats;
+    if (stdev)
+        body.collectStats(stats);
+
+    parallel_for_(Range(0, body.num_jobs()), body);
+
+    if (nlca)
+        CPUnlca(planes);
+    else if (stdev)
+        stdev_threshold(planes, stats, body.num_tiles());
+
+}
+
+// Thresholds planes at mean + thresh_ x standard deviation using statistics
+// collected per tile (tiles_per_plane consecutive entries per plane), either
+// of each plane or of the whole volume
+void saRefocus::stdev_threshold(vector<Mat> &planes, const vector<runningStats> &stats, int tiles_per_plane) {
+
+    vector<runningStats> plane_stats(planes.size());
+    runningStats volume_stats;
+    for (int p=0; p<planes.size(); p++) {
+        for (int t=0; t<tiles_per_plane; t++)
+            plane_stats[p].merge(stats[p*tiles_per_plane + t]);
+        volume_stats.merge(plane_stats[p]);
+    }
+
+    for (int p=0; p<planes.size(); p++) {
+        const runningStats &st = VOLUME_THRESH ? volume_stats : plane_stats[p];
+        double t = st.mean() + thresh_*st.stdev();
+        VLOG(3)<<"Thresholding at: "<<t;
+        threshold(planes[p], planes[p], t, 0, THRESH_TOZERO);
+    }
+
+}
+
+// Turns planes holding the average of clipped samples into NLCA (window
+// max reference) or fast NLCA images using all CPU threads
+void saRefocus::CPUnlca(vector<Mat> &planes) {
+
+    if (delta_ <= 0)
+        LOG(FATAL) << "NLCA delta must be positive!";
+    if (nlca_ && nlca_win_ < 1)
+        LOG(FATAL) << "NLCA window size must be positive!";
+
+    int window = nlca_ ? nlca_win_ : 0;
+    vector<Mat> rowmax;
+    if (window) {
+        rowmax.resize(planes.size());
+        for (int p=0; p<planes.size(); p++)
+            rowmax[p].create(planes[p].size(), CV_32F);
+    }
+
+    nlcaInvoker body(planes, rowmax, window, delta_);
+    if (window) {
+        body.setPass(0);
+        parallel_for_(Range(0, body.num_jobs()), body);
+    }
+    body.setPass(1);
+    parallel_for_(Range(0, body.num_jobs()), body);
+
+}
+
+// Refocuses at z_ by shifting warped images of each camera cached at an
+// earlier depth. For pinhole refocusing the homography only changes along z
+// by a rank one term, so for small steps the map from the new refocused image
+// into the cached warp is close to a translation. The translation at the
+// center is used as long as it is within incr_tol_ pixels of the exact map at
+// the corners and the shift itself is at most incr_tol_ pixels; otherwise all
+// cameras are warped again at z_. Warps extend beyond the refocused image by
+// a margin larger than any accepted shift so that shifting never brings in
+// borders that a direct warp would have filled.
+void saRefocus::CPUrefocus_incremental(int frame, Mat out) {
+
+    vector<Mat> Ms;
+    calc_inverse_Hs(Ms);
+
+    Size size = refocused_size();
+    int margin = cvCeil(incr_tol_) + 1;
+    Size warp_size(size.width + 2*margin, size.height + 2*margin);
+    double key[8] = {rx_, ry_, rz_, xs_, ys_, double(frame), double(level_), double(views_generation_)};
+    bool valid = incr_warps_.size() == num_cams_ && incr_warps_[0].size() == warp_size && incr_roi_ == roi_ && std::equal(key, key+8, incr_key_);
+
+    double cx = (size.width-1)*0.5, cy = (size.height-1)*0.5;
+    double xs[4] = {0, size.width-1.0, 0, size.width-1.0};
+    double ys[4] = {0, 0, size.height-1.0, size.height-1.0};
+
+    vector<Point2d> shifts(num_cams_);
+    for (int i=0; i<num_cams_ && valid; i++) {
+        Mat_<double> G = incr_Ms_[i].inv()*Ms[i];
+        double w = G(2,0)*cx + G(2,1)*cy + G(2,2);
+        shifts[i].x = (G(0,0)*cx + G(0,1)*cy + G(0,2))/w - cx;
+        shifts[i].y = (G(1,0)*cx + G(1,1)*cy + G(1,2))/w - cy;
+        valid = shifts[i].x*shifts[i].x + shifts[i].y*shifts[i].y <= incr_tol_*incr_tol_;
+        for (int c=0; c<4 && valid; c++) {
+            w = G(2,0)*xs[c] + G(2,1)*ys[c] + G(2,2);
+            double ex = (G(0,0)*xs[c] + G(0,1)*ys[c] + G(0,2))/w - xs[c] - shifts[i].x;
+            double ey = (G(1,0)*xs[c] + G(1,1)*ys[c] + G(1,2))/w - ys[c] - shifts[i].y;
+            valid = w > 0 && ex*ex + ey*ey <= incr_tol_*incr_tol_;
+        }
+    }
+
+    if (!valid) {
+
+        VLOG(3)<<"Warping all images for incremental refocusing at z = "<<z_;
+
+        // New buffers so that copies of this object keep their own cache
+        incr_warps_.resize(num_cams_);
+        vector<Mat> occ_sums;
+        Mat T = (Mat_<double>(3,3) << 1, 0, -margin, 0, 1, -margin, 0, 0, 1);
+        for (int i=0; i<num_cams_; i++) {
+            incr_warps_[i] = Mat(warp_size, CV_32F);
+            vector<Mat> views(1, get_view(i, frame));
+            vector< vector<Mat> > M(1, vector<Mat>(1, Mat(Ms[i]*T)));
+            vector<Mat> planes(1, incr_warps_[i]);
+            refocusInvoker body(views, M, planes, tile_rows_, 0, 1, 0, 0, 0, 0, occ_sums, 16);
+            parallel_for_(Range(0, body.num_jobs()), body);
+        }
+
+        incr_Ms_.resize(num_cams_);
+        for (int i=0; i<num_cams_; i++)
+            incr_Ms_[i] = Ms[i].clone();
+        std::copy(key, key+8, incr_key_);
+        incr_roi_ = roi_;
+        shifts.assign(num_cams_, Point2d(0, 0));
+
+    }
+
+    int nlca = nlca_ || nlca_fast_;
+    shiftInvoker body(incr_warps_, margin, shifts, out, mult_, mult_exp_, minlos_, nlca, !nlca && !STDEV_THRESH, thresh_);
+    parallel_for_(Range(0, size.height), body);
+
+    if (nlca) {
+        vector<Mat> planes(1, out);
+        CPUnlca(planes);
+    } else if (STDEV_THRESH) {
+        threshold_image(out);
+    }
+
+}
+
+void saRefocus::CPUrefocus(int live, int frame) {
+
+    Mat out = cpu_output_buffer();
+
+    // Shifted warps carry no per pixel camera coverage or occupancy, so
+    // overlap normalization and sparse refocusing need full warps
+    int incremental = incr_tol_ > 0;
+    if (incremental && (OVERLAP_NORM_FLAG || SPARSE_FLAG)) {
+        LOG_FIRST_N(WARNING, 1) << "Incremental refocusing does not support overlap normalization or sparse refocusing. Warping all images instead.";
+        incremental = 0;
+    }
+
+    if (incremental) {
+        CPUrefocus_incremental(frame, out);
+    } else {
+        vector< vector<Mat> > Ms(1);
+        calc_inverse_Hs(Ms[0]);
+
+        vector<Mat> planes(1, out);
+        CPUrefocus_tiles(Ms, frame, planes, 1);
+    }
+
+    if (live)
+        liveViewWindow(out);
+
+    set_result(out);
+
+}
+
+// Refractive remap map cache
+
+refocusMapCache::refocusMapCache() {
+
+    capacity_ = size_t(1024)*1024*1024;
+    used_ = 0;
+    clock_ = 0;
+    hits_ = 0; misses_ = 0;
+    compact_ = 0;
+
+}
+
+void refocusMapCache::setCapacity(double mb) {
+
+    if (mb < 0)
+        LOG(FATAL) << "Map cache capacity cannot be negative!";
+
+    capacity_ = size_t(mb*1024*1024);
+    evict(0);
+
+}
+
+void refocusMapCache::setPath(string path) {
+
+    if (!path.empty()) {
+        if (*path.rbegin() != '/')
+            path += '/';
+        boost::filesystem::create_directories(path);
+        VLOG(1) << "Persisting refocusing maps in " << path;
+    }
+    path_ = path;
+
+}
+
+void refocusMapCache::setCompact(int flag) {
+
+    if (flag != compact_)
+        clear();
+    compact_ = flag;
+
+}
+
+void refocusMapCache::setTag(string tag) {
+
+    if (tag != tag_) {
+        clear();
+        tag_ = tag;
+    }
+
+}
+
+void refocusMapCache::clear() {
+
+    entries_.clear();
+    used_ = 0;
+
+}
+
+refocusMapCache::map_key refocusMapCache::make_key(int cam, double z) {
+
+    // Depths closer than 1e-6 physical units share a map
+    return map_key(cam, (long long)floor(z*1e6 + 0.5));
+
+}
+
+string refocusMapCache::file_name(map_key key, int compact) {
+
+    boost::hash<string> hasher;
+    stringstream name;
+    name << path_ << "map_" << hex << hasher(tag_) << dec << "_cam" << key.first << "_z" << key.second;
+    if (compact)
+        name << "_c";
+    name << ".bin";
+    return name.str();
+
+}
+
+bool refocusMapCache::get(int cam, double z, Mat &map1, Mat &map2) {
+
+    map_key key = make_key(cam, z);
+
+    std::map<map_key, map_entry>::iterator it = entries_.find(key);
+    if (it != entries_.end()) {
+        it->second.last_used = clock_++;
+        map1 = it->second.map1;
+        map2 = it->second.map2;
+        hits_++;
+        return true;
+    }
+
+    if (!path_.empty() && load(key, map1, map2)) {
+        insert(key, map1, map2);
+        hits_++;
+        return true;
+    }
+
+    misses_++;
+    return false;
+
+}
+
+void refocusMapCache::put(int cam, double z, Mat &map1, Mat &map2, int allow_compact) {
+
+    if (compact_ && allow_compact) {
+        Mat fixed1, fixed2;
+        convertMaps(map1, map2, fixed1, fixed2, CV_16SC2);
+        map1 = fixed1; map2 = fixed2;
+    }
+
+    map_key key = make_key(cam, z);
+    if (!path_.empty())
+        save(key, map1, map2);
+    insert(key, map1, map2);
+
+}
+
+void refocusMapCache::evict(size_t bytes) {
+
+    // Drop least recently used maps until bytes more fit
+    while (!entries_.empty() && used_ + bytes > capacity_) {
+        std::map<map_key, map_entry>::iterator lru = entries_.begin();
+        for (std::map<map_key, map_entry>::iterator it = entries_.begin(); it != entries_.end(); ++it) {
+            if (it->second.last_used < lru->second.last_used)
+                lru = it;
+        }
+        used_ -= lru->second.bytes;
+        entries_.erase(lru);
+    }
+
+}
+
+void refocusMapCache::insert(map_key key, Mat &map1, Mat &map2) {
+
+    std::map<map_key, map_entry>::iterator old = entries_.find(key);
+    if (old != entries_.end()) {
+        used_ -= old->second.bytes;
+        entries_.erase(old);
+    }
+
+    size_t bytes = map1.total()*map1.elemSize() + map2.total()*map2.elemSize();
+    evict(bytes);
+
+    if (bytes == 0 || used_ + bytes > capacity_)
+        return;
+
+    map_entry entry;
+    entry.map1 = map1; entry.map2 = map2;
+    entry.bytes = bytes;
+    entry.last_used = clock_++;
+    entries_[key] = entry;
+    used_ += bytes;
+
+}
+
+bool refocusMapCache::load(map_key key, Mat &map1, Mat &map2) {
+
+    string file = file_name(key, compact_);
+    std::ifstream ifs(file.c_str(), ios::binary);
+    if (!ifs.is_open() && compact_) {
+        file = file_name(key, 0);
+        ifs.open(file.c_str(), ios::binary);
+    }
+    if (!ifs.is_open())
+        return false;
+
+    string tag;
+    try {
+        boost::archive::binary_iarchive ia(ifs);
+        ia >> tag;
+        if (tag != tag_) {
+            LOG(WARNING) << "Ignoring map file " << file << " calculated for a different geometry";
+            return false;
+        }
+        ia >> map1;
+        ia >> map2;
+    } catch (boost::archive::archive_exception &e) {
+        LOG(WARNING) << "Could not read map file " << file << ": " << e.what();
+        return false;
+    }
+
+    VLOG(3) << "Loaded map " << file;
+    return true;
+
+}
+
+void refocusMapCache::save(map_key key, Mat &map1, Mat &map2) {
+
+    string file = file_name(key, map1.type() != CV_32FC1);
+    std::ofstream ofs(file.c_str(), ios::binary);
+    if (!ofs.is_open()) {
+        LOG(WARNING) << "Could not write map file " << file;
+        return;
+    }
+
+    boost::archive::binary_oarchive oa(ofs);
+    oa << tag_;
+    oa << map1;
+    oa << map2;
+
+}
+
+void refractionLUT::build(const double c[3], const double geom[5], double s_max, double tol) {
+
+    for (int i=0; i<3; i++)
+        c_[i] = c[i];
+    for (int i=0; i<5; i++)
+        geom_[i] = geom[i];
+
+    double da = geom[0] - c[2];
+    if (da <= 0 || s_max <= 0 || tol <= 0) {
+        LOG(WARNING) << "Refraction lookup table can not be built for this camera, points will be solved exactly";
+        ns_ = nw_ = 0; h_.clear();
+        return;
+    }
+
+    // w = da/(depth of point from camera) is da/(da+t) on the back face of
+    // the wall and tends to 0 far behind it. Depths beyond 20 times the
+    // camera to wall distance are solved exactly.
+    s_max_ = s_max;
+    w_max_ = da/(da + geom[4]);
+    w_min_ = 0.05*w_max_;
+
+    // Refine the grid until the interpolation error at cell centers, where
+    // it is largest, meets the bound
+    int ns = 8, nw = 8;
+    while (1) {
+
+        ns_ = ns; nw_ = nw;
+        ds_ = s_max_/ns_; dw_ = (w_max_-w_min_)/nw_;
+
+        vector<double> s, w;
+        for (int j=0; j<=nw_; j++) {
+            for (int i=0; i<=ns_; i++) {
+                s.push_back(i*ds_); w.push_back(w_min_ + j*dw_);
+            }
+        }
+        exact(s, w, h_);
+
+        s.clear(); w.clear();
+        for (int j=0; j<nw_; j++) {
+            for (int i=0; i<ns_; i++) {
+                s.push_back((i+0.5)*ds_); w.push_back(w_min_ + (j+0.5)*dw_);
+            }
+        }
+        vector<double> h;
+        exact(s, w, h);
+
+        // An error in h moves the crossing point by s*da*error
+        err_ = 0;
+        for (int p=0; p<h.size(); p++)
+            err_ = max(err_, s[p]*da*fabs(eval(s[p], w[p]) - h[p]));
+
+        if (err_ <= tol)
+            break;
+
+        if (size_t(ns_+1)*(nw_+1) > (1<<22)) {
+            LOG(WARNING) << "Refraction lookup table error is " << err_ << " which exceeds the bound of " << tol;
+            break;
+        }
+
+        ns *= 2; nw *= 2;
+
+    }
+
+    VLOG(1) << "Refraction lookup table with " << ns_+1 << " x " << nw_+1 << " nodes, error " << err_;
+
+}
+
+void refractionLUT::exact(const vector<double> &s, const vector<double> &w, vector<double> &h) const {
+
+    // Points along the x axis through the camera. h is even in s so the
+    // value at s = 0 is taken from a slightly larger slope.
+    int n = s.size();
+    double da = geom_[0] - c_[2];
+    vector<double> x(n), y(n, c_[1]), z(n), ax(n), ay(n);
+    for (int p=0; p<n; p++) {
+        double sp = max(s[p], 1e-6*s_max_);
+        x[p] = c_[0] + sp*da/w[p];
+        z[p] = c_[2] + da/w[p];
+    }
+    refract_points(c_, geom_, &x[0], &y[0], &z[0], &ax[0], &ay[0], n);
+
+    h.resize(n);
+    for (int p=0; p<n; p++) {
+        double sp = max(s[p], 1e-6*s_max_);
+        h[p] = (ax[p]-c_[0])/(sp*da);
+    }
+
+}
+
+bool refractionLUT::matches(const double c[3], const double geom[5]) const {
+
+    if (ns_ < 0)
+        return false;
+    for (int i=0; i<3; i++)
+        if (c[i] != c_[i])
+            return false;
+    for (int i=0; i<5; i++)
+        if (geom[i] != geom_[i])
+            return false;
+    return true;
+
+}
+
+double refractionLUT::eval(double s, double w) const {
+
+    // Four node stencils are shifted inwards at the edges of the table
+    double u = s/ds_, v = (w-w_min_)/dw_;
+    int i = min(max(int(u)-1, 0), ns_-3);
+    int j = min(max(int(v)-1, 0), nw_-3);
+
+    double ws[4], ww[4];
+    cubic_weights(u-i-1, ws);
+    cubic_weights(v-j-1, ww);
+
+    double h = 0;
+    for (int b=0; b<4; b++) {
+        const double* row = &h_[(j+b)*(ns_+1) + i];
+        h += ww[b]*(ws[0]*row[0] + ws[1]*row[1] + ws[2]*row[2] + ws[3]*row[3]);
+    }
+    return h;
+
+}
+
+void refractionLUT::refract(const double* x, const double* y, const double* z, double* ax, double* ay, int n) const {
+
+    if (empty()) {
+        refract_points(c_, geom_, x, y, z, ax, ay, n);
+        return;
+    }
+
+    double da = geom_[0] - c_[2];
+    for (int p=0; p<n; p++) {
+
+        double dx = x[p]-c_[0], dy = y[p]-c_[1], dz = z[p]-c_[2];
+        double rp = sqrt(dx*dx + dy*dy);
+        double s = rp/dz, w = da/dz;
+        if (dz <= 0 || s > s_max_ || w < w_min_ || w > w_max_) {
+            refract_points(c_, geom_, x+p, y+p, z+p, ax+p, ay+p, 1);
+            continue;
+        }
+
+        // Crossing point is h times the straight line crossing point
+        double r = eval(s, w)*da/dz;
+        ax[p] = c_[0] + dx*r;
+        ay[p] = c_[1] + dy*r;
+
+    }
+
+}
+
+string saRefocus::ref_map_tag() {
+
+    // Everything other than depth that a refractive map depends on
+    stringstream tag;
+    tag.precision(17);
+    Rect r = roi();
+    tag << img_size_.width << " " << img_size_.height << " " << scale_ << " ";
+    tag << r.x << " " << r.y << " " << r.width << " " << r.height << " ";
+    tag << NR_ITERS << " " << NR_TOL << " " << ref_lut_tol_ << " ";
+    for (int i=0; i<5; i++)
+        tag << geom[i] << " ";
+    for (int i=0; i<ref_layers_.size(); i++)
+        tag << ref_layers_[i] << " ";
+    for (int i=0; i<num_cams_; i++) {
+        Mat_<double> P, C;
+        P_mats_[i].convertTo(P, CV_64F);
+        cam_locations_[i].convertTo(C, CV_64F);
+        for (MatIterator_<double> it = P.begin(); it != P.end(); ++it)
+            tag << *it << " ";
+        for (MatIterator_<double> it = C.begin(); it != C.end(); ++it)
+            tag << *it << " ";
+    }
+
+    return tag.str();
+
+}
+
+void saRefocus::get_ref_refocus_map(int cam, double z, Mat &map1, Mat &map2) {
+
+    if (ref_map_dz_ > 0) {
+        interp_ref_refocus_map(cam, z, map1, map2);
+        return;
+    }
+
+    if (map_cache_.get(cam, z, map1, map2))
+        return;
+
+    Size size = refocused_size();
+    Mat_<double> x = scratch().get(size, CV_64F);
+    Mat_<double> y = scratch().get(size, CV_64F);
+    calc_ref_refocus_map(cam_locations_[cam], z, x, y, cam);
+
+    // map1 and map2 may still refer to maps held by the cache so new maps
+    // must not be converted into them
+    map1 = Mat(); map2 = Mat();
+    x.convertTo(map1, CV_32FC1);
+    y.convertTo(map2, CV_32FC1);
+    map_cache_.put(cam, z, map1, map2);
+
+}
+
+void saRefocus::get_ref_lattice_map(int cam, double z, Mat &xmap, Mat &ymap) {
+
+    // Lattice maps are interpolated so they are always kept as floats
+    if (map_cache_.get(cam, z, xmap, ymap) && xmap.type() == CV_32FC1)
+        return;
+
+    Size size = refocused_size();
+    Mat_<double> x = scratch().get(size, CV_64F);
+    Mat_<double> y = scratch().get(size, CV_64F);
+    calc_ref_refocus_map(cam_locations_[cam], z, x, y, cam);
+
+    xmap = Mat(); ymap = Mat();
+    x.convertTo(xmap, CV_32FC1);
+    y.convertTo(ymap, CV_32FC1);
+    map_cache_.put(cam, z, xmap, ymap, 0);
+
+}
+
+void saRefocus::interp_ref_refocus_map(int cam, double z, Mat &map1, Mat &map2) {
+
+    if (ref_lattice_dz_.size() != num_cams_) {
+        ref_lattice_dz_.assign(num_cams_, ref_map_dz_);
+        ref_lattice_ok_.assign(num_cams_, set<long long>());
+    }
+
+    // Shrink lattice spacing until the interval containing z meets the
+    // error bound
+    long long k;
+    double t;
+    while (1) {
+
+        double h = ref_lattice_dz_[cam];
+        k = (long long)floor(z/h);
+        t = z/h - k;
+
+        if (ref_lattice_ok_[cam].count(k))
+            break;
+
+        double err = ref_lattice_error(cam, k, h);
+        if (err <= ref_map_tol_) {
+            VLOG(1) << "Camera " << cam << " refractive map interpolation error between z = " << k*h << " and " << (k+1)*h << " is " << err << " px";
+            ref_lattice_ok_[cam].insert(k);
+            break;
+        }
+
+        if (h < 1e-3*ref_map_dz_) {
+            LOG(WARNING) << "Could not reach refractive map interpolation error bound of " << ref_map_tol_ << " px (error is " << err << " px) for camera " << cam << " at z = " << z;
+            ref_lattice_ok_[cam].insert(k);
+            break;
+        }
+
+        VLOG(1) << "Camera " << cam << " refractive map interpolation error " << err << " px exceeds bound, halving lattice spacing to " << h*0.5;
+        ref_lattice_dz_[cam] = h*0.5;
+        ref_lattice_ok_[cam].clear();
+
+    }
+
+    double h = ref_lattice_dz_[cam];
+    if (t < 1e-9) {
+        get_ref_lattice_map(cam, k*h, map1, map2);
+        return;
+    }
+
+    double w[4];
+    cubic_weights(t, w);
+
+    Mat xn[4], yn[4];
+    for (int n=0; n<4; n++)
+        get_ref_lattice_map(cam, (k-1+n)*h, xn[n], yn[n]);
+
+    // Interpolated maps are not cached so they live in the scratch arena
+    Size size = xn[0].size();
+    map1 = scratch().get(size, CV_32FC1);
+    map2 = scratch().get(size, CV_32FC1);
+    Mat tmp = scratch().get(size, CV_32FC1);
+    addWeighted(xn[0], w[0], xn[1], w[1], 0, map1);
+    addWeighted(xn[2], w[2], xn[3], w[3], 0, tmp);
+    map1 += tmp;
+    addWeighted(yn[0], w[0], yn[1], w[1], 0, map2);
+    addWeighted(yn[2], w[2], yn[3], w[3], 0, tmp);
+    map2 += tmp;
+
+}
+
+scratchArena& saRefocus::scratch() {
+
+    if (!scratch_->get())
+        scratch_->reset(new scratchArena);
+    return *scratch_->get();
+
+}
+
+double saRefocus::ref_lattice_error(int cam, long long k, double h) {
+
+    // Compare interpolated and exact maps halfway between lattice nodes, where
+    // the cubic error is largest, on a sparse grid of pixels
+    int step = 8;
+    Rect r = roi();
+    vector<Point> pts;
+    for (int i=0; i<r.width; i+=step)
+        for (int j=0; j<r.height; j+=step)
+            pts.push_back(Point(i, j));
+
+    Mat_<double> X = scratch().get(3, pts.size(), CV_64F);
+    for (int p=0; p<pts.size(); p++) {
+        X(0,p) = pts[p].x + r.x; X(1,p) = pts[p].y + r.y; X(2,p) = 1;
+    }
+
+    Mat_<double> proj;
+    calc_ref_refocus_pts(cam_locations_[cam], (k+0.5)*h, X, proj, cam);
+
+    double w[4];
+    cubic_weights(0.5, w);
+
+    Mat xn[4], yn[4];
+    for (int n=0; n<4; n++)
+        get_ref_lattice_map(cam, (k-1+n)*h, xn[n], yn[n]);
+
+    double err = 0;
+    for (int p=0; p<pts.size(); p++) {
+        double xi = 0, yi = 0;
+        for (int n=0; n<4; n++) {
+            xi += w[n]*xn[n].at<float>(pts[p]);
+            yi += w[n]*yn[n].at<float>(pts[p]);
+        }
+        err = max(err, max(fabs(xi-proj(0,p)), fabs(yi-proj(1,p))));
+    }
+
+    return err;
+
+}
+
+void saRefocus::CPUrefocus_ref(int live, int frame) {
+
+    string tag = ref_map_tag();
+    if (tag != ref_lattice_tag_) {
+        ref_lattice_dz_.clear();
+        ref_lattice_tag_ = tag;
+    }
+    map_cache_.setTag(tag);
+
+    // Integer images are scaled to [0, 1] as they are accumulated
+    double scale = 1.0/num_cams_;
+    Mat view = get_view(0, frame);
+    if (view.depth() == CV_8U)
+        scale /= 255.0;
+    else if (view.depth() == CV_16U)
+        scale /= 65535.0;
+
+    // Temporaries are drawn from the scratch arena so repeated calls with the
+    // same geometry do not allocate
+    scratchArena &arena = scratch();
+    arena.reset();
+
+    Size size = refocused_size();
+    Mat res = arena.get(size, view.type());
+    Mat resf = arena.get(size, CV_32F);
+    Mat xmap, ymap;
+    get_ref_refocus_map(0, z_, xmap, ymap);
+    remap(view, res, xmap, ymap, INTER_LINEAR);
+
+    // NLCA averages samples clipped to 1, which only float images can exceed
+    int clip = (nlca_ || nlca_fast_) && view.depth() == CV_32F;
+
+    // Maps cover the refocused image so this writes into the output buffer
+    Mat out = cpu_output_buffer();
+    res.convertTo(out, CV_32F, scale);
+    if (clip)
+        min(out, scale, out);
+
+    for (int i=1; i<num_cams_; i++) {
+
+        get_ref_refocus_map(i, z_, xmap, ymap);
+
+        Mat img = get_view(i, frame);
+        if (img.type() != res.type())
+            res = arena.get(size, img.type());
+        remap(img, res, xmap, ymap, INTER_LINEAR);
+
+        res.convertTo(resf, CV_32F, scale);
+        if (clip)
+            min(resf, scale, resf);
+        out += resf;
+
+    }
+
+    if (nlca_ || nlca_fast_) {
+        vector<Mat> planes(1, out);
+        CPUnlca(planes);
+    }
+
+    // TODO: thresholding missing?
+
+    if (live)
+        liveViewWindow(out);
+
+    set_result(out);
+
+}
+
+void saRefocus::CPUrefocus_ref_corner(int live, int frame) {
+
+    vector< vector<Mat> > Ms(1);
+    calc_inverse_Hs(Ms[0]);
+
+    Mat out = cpu_output_buffer();
+    vector<Mat> planes(1, out);
+
+    // TODO: thresholding missing?
+    CPUrefocus_tiles(Ms, frame, planes, 0);
+
+    if (live)
+        liveViewWindow(out);
+
+    set_result(out);
+
+}
+
+// ---CPU Refocusing Functions End--- //
+
+void saRefocus::calc_ref_refocus_map(Mat_<double> Xcam, double z, Mat_<double> &x, Mat_<double> &y, int cam) {
+
+    // x and y cover the region of interest
+    int width = x.cols;
+    int height = x.rows;
+    Rect r = roi();
+
+    // Pixels are stored row by row so the refraction solver can start each
+    // row from the solutions of the row above
+    Mat_<double> X = scratch().get(3, height*width, CV_64F);
+    for (int j=0; j<height; j++) {
+        for (int i=0; i<width; i++) {
+            X(0,j*width+i) = i + r.x;
+            X(1,j*width+i) = j + r.y;
+            X(2,j*width+i) = 1;
+        }
+    }
+
+    Mat_<double> proj = scratch().get(3, height*width, CV_64F);
+    calc_ref_refocus_pts(Xcam, z, X, proj, cam, width);
+
+    for (int j=0; j<height; j++) {
+        for (int i=0; i<width; i++) {
+            x(j,i) = proj(0,j*width+i);
+            y(j,i) = proj(1,j*width+i);
+        }
+    }
+
+}
+
+void saRefocus::calc_ref_refocus_pts(Mat_<double> Xcam, double z, Mat_<double> X, Mat_<double> &proj, int cam, int cols) {
+
+    // Inverse of the scaling D from world to refocused image coordinates,
+    // applied directly so the points are written into a scratch buffer
+    double cx = img_size_.width*0.5, cy = img_size_.height*0.5;
+    Mat_<double> Xw = scratch().get(3, X.cols, CV_64F);
+    for (int i=0; i<X.cols; i++) {
+        Xw(0,i) = (X(0,i) - cx*X(2,i))/scale_;
+        Xw(1,i) = (X(1,i) - cy*X(2,i))/scale_;
+        Xw(2,i) = z;
+    }
+
+    //cout<<"Refracting points"<<endl;
+    Mat_<double> X_out = scratch().get(4, X.cols, CV_64F);
+    img_refrac(cam, Xw, X_out, cols);
+
+    //cout<<"Projecting to find final map"<<endl;
+    Matx34d P;
+    Mat Pd(3, 4, CV_64F, P.val);
+    P_mats_[cam].convertTo(Pd, CV_64F);
+    if (proj.rows != 3 || proj.cols != X.cols)
+        proj = scratch().get(3, X.cols, CV_64F);
+    for (int i=0; i<X.cols; i++) {
+        double p[3];
+        for (int r=0; r<3; r++)
+            p[r] = P(r,0)*X_out(0,i) + P(r,1)*X_out(1,i) + P(r,2)*X_out(2,i) + P(r,3)*X_out(3,i);
+        proj(0,i) = p[0]/p[2];
+        proj(1,i) = p[1]/p[2];
+        proj(2,i) = p[2];
+    }
+
+}
+
+void saRefocus::calc_refocus_map(Mat_<double> &x, Mat_<double> &y, int cam) {
+
+    int width = img_size_.width;
+    int height = img_size_.height;
+
+    Mat_<double> D = Mat_<double>::zeros(3,3);
+    D(0,0) = scale_; D(1,1) = scale_;
+    D(0,2) = width*0.5;
+    D(1,2) = height*0.5;
+    D(2,2) = 1;
+    Mat hinv = D.inv();
+
+    Mat_<double> X = Mat_<double>::zeros(3, height*width);
+    for (int i=0; i<width; i++) {
+        for (int j=0; j<height; j++) {
+            X(0,i*height+j) = i;
             X(1,i*height+j) = j;
             X(2,i*height+j) = 1;
         }
@@ -1534,6 +3695,23 @@ void saRefocus::calc_refocus_map(Mat_<double> &x, Mat_<double> &y, int cam) {
 
 void saRefocus::calc_ref_refocus_H(int cam, Mat &H) {
 
+    // The focal plane passes through [xs ys z] and its normal is the z axis
+    // rotated by the plane rotation
+    Mat_<double> R = getRotMat(rx_, ry_, rz_);
+    Mat_<double> plane(1, 4);
+    for (int i=0; i<3; i++)
+        plane(0,i) = R(i,2);
+    plane(0,3) = R(0,2)*xs_ + R(1,2)*ys_ + R(2,2)*z_;
+
+    calc_ref_plane_H(cam, plane, H);
+
+}
+
+// Fits the refractive homography of camera cam for the plane n.X = d given as
+// (nx, ny, nz, d) through the corners of the image. The plane point refocused
+// at an output pixel is the one above the pixel's world x and y.
+void saRefocus::calc_ref_plane_H(int cam, const Mat_<double> &plane, Mat &H) {
+
     Mat_<double> X = Mat_<double>::zeros(3, 4);
     X(0,0) = 0;                 X(1,0) = 0;
     X(0,3) = img_size_.width-1; X(1,3) = 0;
@@ -1541,18 +3719,15 @@ void saRefocus::calc_ref_refocus_H(int cam, Mat &H) {
     X(0,1) = 0;                 X(1,1) = img_size_.height-1;
     X = hinv_*X;
 
-    // Mat R = getRotMat(rx_, ry_, rz_);
-    // X = R*X;
-
     Mat_<double> X2 = Mat_<double>::zeros(3, 4);
     for (int j=0; j<X.cols; j++) {
         X2(0,j) = X(0,j) + xs_;
         X2(1,j) = X(1,j) + ys_;
-        X2(2,j) = X(2,j) + z_;
+        X2(2,j) = (plane(0,3) - plane(0,0)*X2(0,j) - plane(0,1)*X2(1,j))/plane(0,2);
     }
 
     Mat_<double> X_out = Mat_<double>::zeros(4, 4);
-    img_refrac(cam_locations_[cam], X2, X_out);
+    img_refrac(cam, X2, X_out);
 
     Mat_<double> proj = P_mats_[cam]*X_out;
 
@@ -1573,42 +3748,149 @@ void saRefocus::calc_ref_refocus_H(int cam, Mat &H) {
 
 void saRefocus::calc_refocus_H(int cam, Mat &H) {
 
-    Mat_<double> X = Mat_<double>::zeros(3, 4);
-    X(0,0) = 0;                 X(1,0) = 0;
-    X(0,1) = img_size_.width-1; X(1,1) = 0;
-    X(0,2) = img_size_.width-1; X(1,2) = img_size_.height-1;
-    X(0,3) = 0;                 X(1,3) = img_size_.height-1;
-    X = hinv_*X;
+    build_homography_sweep();
 
-    Mat_<double> X2 = Mat_<double>::zeros(4, 4);
+    Mat H_inv;
+    calc_refocus_H_inv(cam, z_, H_inv);
+    H = H_inv.inv();
+    H /= H.at<double>(2,2);
 
-    for (int i=0; i<X.cols; i++)
-        X(2,i) = 0; //z_;
+}
 
-    Mat R = getRotMat(rx_, ry_, rz_);
-    X = R*X;
+// Builds the homography sweep table for the current plane orientation and
+// shift. A point s on the focal plane (in the coordinates used by the output
+// image, s = hinv_*pixel) maps to world point Q*inv(A)*s + [xs ys z], where Q
+// holds the first two columns of the rotation matrix and A is its top 2x2
+// block. Projecting through P, the destination to source homography is then
+// affine in z: base + z*slope, where only base depends on the orientation.
+void saRefocus::build_homography_sweep() {
+
+    double pose[5] = {rx_, ry_, rz_, xs_, ys_};
+    if (hsweep_valid_ && hsweep_base_.size() == num_cams_ && std::equal(pose, pose+5, hsweep_pose_))
+        return;
+
+    VLOG(3)<<"Building homography sweep table...";
+
+    Mat_<double> R = getRotMat(rx_, ry_, rz_);
+    Mat_<double> Q = R.colRange(0, 2);
+    Mat_<double> A = Q.rowRange(0, 2);
+    Mat_<double> QA = Q*A.inv();
+    Mat_<double> shift = (Mat_<double>(3,1) << xs_, ys_, 0);
+
+    hsweep_base_.resize(num_cams_);
+    hsweep_slope_.resize(num_cams_);
+
+    for (int n=0; n<num_cams_; n++) {
+
+        Mat_<double> P = P_mats_[n];
+        Mat_<double> PQA = P.colRange(0, 3)*QA;
+        Mat_<double> t = P.colRange(0, 3)*shift + P.col(3);
+
+        Mat_<double> base = Mat_<double>::zeros(3,3);
+        Mat_<double> slope = Mat_<double>::zeros(3,3);
+        for (int i=0; i<3; i++) {
+            base(i,0) = PQA(i,0);
+            base(i,1) = PQA(i,1);
+            base(i,2) = t(i,0);
+            slope(i,2) = P(i,2);
+        }
+
+        hsweep_base_[n] = base*hinv_;
+        hsweep_slope_[n] = slope*hinv_;
 
-    for (int j=0; j<X.cols; j++) {
-        X2(0,j) = X(0,j) + xs_;
-        X2(1,j) = X(1,j) + ys_;
-        X2(2,j) = X(2,j)+z_;
-        X2(3,j) = 1;
     }
 
-    Mat_<double> proj = P_mats_[cam]*X2;
+    std::copy(pose, pose+5, hsweep_pose_);
+    hsweep_valid_ = 1;
 
-    Point2f src, dst;
-    vector<Point2f> sp, dp;
-    int i, j;
+}
 
-    for (int i=0; i<X.cols; i++) {
-        src.x = X(0,i); src.y = X(1,i);
-        dst.x = proj(0,i)/proj(2,i); dst.y = proj(1,i)/proj(2,i);
-        sp.push_back(src); dp.push_back(dst);
+// Calculates the inverse homographies of all cameras (ROI and pyramid level
+// included, like calc_inverse_Hs()) for a batch of planes n.X = d, one
+// (nx, ny, nz, d) row per plane. The plane point refocused at output pixel
+// s = hinv_*pixel is (s + [xs ys], Z) with Z from the plane equation, as for
+// rotated planes in build_homography_sweep(). Projected through P, the
+// homography of a camera is B + P.col(2)*r where B only depends on the camera
+// and the row r = [-nx, -ny, d - nx*xs - ny*ys]/nz*hinv_ only on the plane, so
+// the whole batch costs one rank one update per camera and plane.
+void saRefocus::calc_plane_Hs_inv(const Mat_<double> &poses, vector< vector<Mat> > &Ms) {
+
+    int num_planes = poses.rows;
+    for (int k=0; k<num_planes; k++) {
+        if (fabs(poses(k,2)) <= 1e-9*norm(poses.row(k).colRange(0, 3)))
+            LOG(FATAL) << "Planes parallel to the z axis cannot be refocused!";
     }
 
-    H = findHomography(dp, sp, 0);
-    H = D_*H;
+    Mat_<double> T = Mat_<double>::eye(3, 3);
+    if (roi_.area()) {
+        T(0,2) = roi_.x;
+        T(1,2) = roi_.y;
+    }
+    Mat_<double> hT = hinv_*T;
+
+    Ms.resize(num_planes);
+    for (int k=0; k<num_planes; k++)
+        Ms[k].resize(num_cams_);
+
+    if (REF_FLAG) {
+        Mat H;
+        for (int k=0; k<num_planes; k++) {
+            for (int i=0; i<num_cams_; i++) {
+                calc_ref_plane_H(i, poses.row(k), H);
+                H.convertTo(H, CV_64F);
+                Ms[k][i] = H.inv()*Mat(T);
+            }
+            scale_to_level(Ms[k]);
+        }
+        return;
+    }
+
+    Mat_<double> rs(num_planes, 3);
+    for (int k=0; k<num_planes; k++) {
+        double nz = poses(k,2);
+        rs(k,0) = -poses(k,0)/nz;
+        rs(k,1) = -poses(k,1)/nz;
+        rs(k,2) = (poses(k,3) - poses(k,0)*xs_ - poses(k,1)*ys_)/nz;
+    }
+    Mat_<double> rh = rs*hT;
+
+    for (int n=0; n<num_cams_; n++) {
+
+        Mat_<double> P = P_mats_[n];
+        Mat_<double> B = Mat_<double>::zeros(3, 3);
+        for (int i=0; i<3; i++) {
+            B(i,0) = P(i,0);
+            B(i,1) = P(i,1);
+            B(i,2) = P(i,0)*xs_ + P(i,1)*ys_ + P(i,3);
+        }
+        B = B*hT;
+
+        for (int k=0; k<num_planes; k++) {
+            Mat_<double> M = B.clone();
+            for (int i=0; i<3; i++)
+                for (int j=0; j<3; j++)
+                    M(i,j) += P(i,2)*rh(k,j);
+            Ms[k][n] = M;
+        }
+
+    }
+
+    for (int k=0; k<num_planes; k++)
+        scale_to_level(Ms[k]);
+
+}
+
+// Evaluates the destination to source homography of camera cam for a plane at
+// depth z from the sweep table (build_homography_sweep() must be called first)
+void saRefocus::calc_refocus_H_inv(int cam, double z, Mat &H_inv) {
+
+    H_inv.create(3, 3, CV_64F);
+
+    const double* base = hsweep_base_[cam].ptr<double>();
+    const double* slope = hsweep_slope_[cam].ptr<double>();
+    double* h = H_inv.ptr<double>();
+    for (int i=0; i<9; i++)
+        h[i] = base[i] + z*slope[i];
 
 }
 
@@ -1617,7 +3899,7 @@ void saRefocus::calc_refocus_H(int cam, Mat &H) {
 Mat saRefocus::project_point(int cam, Mat_<double> X) {
 
     Mat_<double> X_out = Mat_<double>::zeros(4,1);
-    img_refrac(cam_locations_[cam], X, X_out);
+    img_refrac(cam, X, X_out);
 
     Mat_<double> proj = P_mats_[cam]*X_out;
 
@@ -1631,157 +3913,127 @@ Mat saRefocus::project_point(int cam, Mat_<double> X) {
 
 void saRefocus::img_refrac(Mat_<double> Xcam, Mat_<double> X, Mat_<double> &X_out) {
 
-    float zW_ = geom[0]; float n1_ = geom[1]; float n2_ = geom[2]; float n3_ = geom[3]; float t_ = geom[4];
-
-    double c[3];
+    // Rows of X and X_out are contiguous so they are solved in place
+    double c[3], g[REFRAC_GEOM_SIZE(REFRAC_MAX_LAYERS)];
     for (int i=0; i<3; i++)
         c[i] = Xcam.at<double>(0,i);
+    int layers = ref_geom(g);
+
+    if (layers > 1)
+        refract_layers(c, g, layers, X[0], X[1], X[2], X_out[0], X_out[1], X.cols);
+    else
+        refract_points(c, g, X[0], X[1], X[2], X_out[0], X_out[1], X.cols, NR_ITERS);
+    X_out.row(2).setTo(geom[0]);
+    X_out.row(3).setTo(1.0);
 
-    double a[3];
-    double b[3];
-    double point[3];
-    double rp, dp, phi, ra, rb, da, db;
-    double f, g, dfdra, dfdrb, dgdra, dgdrb;
+}
 
-    for (int n=0; n<X.cols; n++) {
+void saRefocus::img_refrac(int cam, Mat_<double> X, Mat_<double> &X_out, int cols) {
 
-        for (int i=0; i<3; i++)
-            point[i] = X(i,n);
-
-        a[0] = c[0] + (point[0]-c[0])*(zW_-c[2])/(point[2]-c[2]);
-        a[1] = c[1] + (point[1]-c[1])*(zW_-c[2])/(point[2]-c[2]);
-        a[2] = zW_;
-        b[0] = c[0] + (point[0]-c[0])*(t_+zW_-c[2])/(point[2]-c[2]);
-        b[1] = c[1] + (point[1]-c[1])*(t_+zW_-c[2])/(point[2]-c[2]);
-        b[2] = t_+zW_;
-
-        rp = sqrt( pow(point[0]-c[0],2) + pow(point[1]-c[1],2) );
-        dp = point[2]-b[2];
-        phi = atan2(point[1]-c[1],point[0]-c[0]);
-
-        ra = sqrt( pow(a[0]-c[0],2) + pow(a[1]-c[1],2) );
-        rb = sqrt( pow(b[0]-c[0],2) + pow(b[1]-c[1],2) );
-        da = a[2]-c[2];
-        db = b[2]-a[2];
-
-        // Newton Raphson loop to solve for Snell's law
-        double tol = IMG_REFRAC_TOL;
-        double ra1, rb1, res;
-        ra1 = ra; rb1 = rb;
-        VLOG(4)<<"img_refrac() Newton Raphson solver progress:";
-        int i;
-        for (i=0; i<MAX_NR_ITERS; i++) {
-
-            f = ( ra/sqrt(pow(ra,2)+pow(da,2)) ) - ( (n2_/n1_)*(rb-ra)/sqrt(pow(rb-ra,2)+pow(db,2)) );
-            g = ( (rb-ra)/sqrt(pow(rb-ra,2)+pow(db,2)) ) - ( (n3_/n2_)*(rp-rb)/sqrt(pow(rp-rb,2)+pow(dp,2)) );
-
-            dfdra = ( (1.0)/sqrt(pow(ra,2)+pow(da,2)) )
-                - ( pow(ra,2)/pow(pow(ra,2)+pow(da,2),1.5) )
-                + ( (n2_/n1_)/sqrt(pow(ra-rb,2)+pow(db,2)) )
-                - ( (n2_/n1_)*(ra-rb)*(2*ra-2*rb)/(2*pow(pow(ra-rb,2)+pow(db,2),1.5)) );
-
-            dfdrb = ( (n2_/n1_)*(ra-rb)*(2*ra-2*rb)/(2*pow(pow(ra-rb,2)+pow(db,2),1.5)) )
-                - ( (n2_/n1_)/sqrt(pow(ra-rb,2)+pow(db,2)) );
-
-            dgdra = ( (ra-rb)*(2*ra-2*rb)/(2*pow(pow(ra-rb,2)+pow(db,2),1.5)) )
-                - ( (1.0)/sqrt(pow(ra-rb,2)+pow(db,2)) );
-
-            dgdrb = ( (1.0)/sqrt(pow(ra-rb,2)+pow(db,2)) )
-                + ( (n3_/n2_)/sqrt(pow(rb-rp,2)+pow(dp,2)) )
-                - ( (ra-rb)*(2*ra-2*rb)/(2*pow(pow(ra-rb,2)+pow(db,2),1.5)) )
-                - ( (n3_/n2_)*(rb-rp)*(2*rb-2*rp)/(2*pow(pow(rb-rp,2)+pow(dp,2),1.5)) );
-
-            ra = ra - ( (f*dgdrb - g*dfdrb)/(dfdra*dgdrb - dfdrb*dgdra) );
-            rb = rb - ( (g*dfdra - f*dgdra)/(dfdra*dgdrb - dfdrb*dgdra) );
-
-            res = abs(ra1-ra)+abs(rb1-rb);
-            VLOG(4)<<(i+1)<<": "<<res;
-            ra1 = ra; rb1 = rb;
-            if (res < tol) {
-                VLOG(4)<<"Tolerance reached. Terminating solver...";
-                break;
-            }
+    double c[3], g[REFRAC_GEOM_SIZE(REFRAC_MAX_LAYERS)];
+    for (int i=0; i<3; i++)
+        c[i] = cam_locations_[cam].at<double>(0,i);
+    int layers = ref_geom(g);
 
-        }
+    if (layers > 1) {
 
-        VLOG(3)<<"# NR iterations to convergence: "<<(i+1);
-        if (i+1==MAX_NR_ITERS)
-            LOG(WARNING)<<"Maximum iterations were reached for the NR solver in img_refrac()";
+        // Stacks of layers converge in a few iterations from the paraxial
+        // guess, so neither tables nor warm starts are used for them
+        refract_layers(c, g, layers, X[0], X[1], X[2], X_out[0], X_out[1], X.cols);
 
-        a[0] = ra*cos(phi) + c[0];
-        a[1] = ra*sin(phi) + c[1];
+    } else if (ref_lut_tol_ > 0) {
 
-        X_out(0,n) = a[0];
-        X_out(1,n) = a[1];
-        X_out(2,n) = a[2];
-        X_out(3,n) = 1.0;
+        // Tables are rebuilt if cameras or the wall changed since they were built
+        if (ref_luts_.size() != num_cams_)
+            ref_luts_.resize(num_cams_);
+        if (!ref_luts_[cam].matches(c, g))
+            build_ref_lut(cam);
 
-    }
+        ref_luts_[cam].refract(X[0], X[1], X[2], X_out[0], X_out[1], X.cols);
+
+    } else if (cols > 0) {
 
-    // for (int n=0; n<X.cols; n++) {
+        refracStats stats;
+        refract_grid(c, g, X[0], X[1], X[2], X_out[0], X_out[1], X.cols/cols, cols, NR_TOL, MAX_NR_ITERS, &stats);
+        VLOG(2) << "Refraction solver for camera " << cam << " took " << stats.mean() << " iterations per point on average and at most " << stats.max_iters;
 
-    //     double a[3];
-    //     double b[3];
-    //     double point[3];
-    //     for (int i=0; i<3; i++)
-    //         point[i] = X(i,n);
+    } else {
+
+        refract_points(c, g, X[0], X[1], X[2], X_out[0], X_out[1], X.cols, NR_ITERS);
+
+    }
 
-    //     a[0] = c[0] + (point[0]-c[0])*(zW_-c[2])/(point[2]-c[2]);
-    //     a[1] = c[1] + (point[1]-c[1])*(zW_-c[2])/(point[2]-c[2]);
-    //     a[2] = zW_;
-    //     b[0] = c[0] + (point[0]-c[0])*(t_+zW_-c[2])/(point[2]-c[2]);
-    //     b[1] = c[1] + (point[1]-c[1])*(t_+zW_-c[2])/(point[2]-c[2]);
-    //     b[2] = t_+zW_;
+    X_out.row(2).setTo(geom[0]);
+    X_out.row(3).setTo(1.0);
 
-    //     double rp = sqrt( pow(point[0]-c[0],2) + pow(point[1]-c[1],2) );
-    //     double dp = point[2]-b[2];
-    //     double phi = atan2(point[1]-c[1],point[0]-c[0]);
+}
 
-    //     double ra = sqrt( pow(a[0]-c[0],2) + pow(a[1]-c[1],2) );
-    //     double rb = sqrt( pow(b[0]-c[0],2) + pow(b[1]-c[1],2) );
-    //     double da = a[2]-c[2];
-    //     double db = b[2]-a[2];
+void saRefocus::build_ref_luts() {
 
-    //     double f, g, dfdra, dfdrb, dgdra, dgdrb;
+    if (ref_lut_tol_ <= 0 || !REF_FLAG || cam_locations_.size() != num_cams_)
+        return;
 
-    //     // Newton Raphson loop to solve for Snell's law
-    //     double tol=1E-8;
+    if (ref_layers_.size()) {
+        LOG(WARNING) << "Refraction tables only support a single wall and are not used with further layers";
+        ref_luts_.clear();
+        return;
+    }
 
-    //     for (int i=0; i<20; i++) {
+    ref_luts_.resize(num_cams_);
+    for (int i=0; i<num_cams_; i++)
+        build_ref_lut(i);
 
-    //         f = ( ra/sqrt(pow(ra,2)+pow(da,2)) ) - ( (n2_/n1_)*(rb-ra)/sqrt(pow(rb-ra,2)+pow(db,2)) );
-    //         g = ( (rb-ra)/sqrt(pow(rb-ra,2)+pow(db,2)) ) - ( (n3_/n2_)*(rp-rb)/sqrt(pow(rp-rb,2)+pow(dp,2)) );
+}
 
-    //         dfdra = ( (1.0)/sqrt(pow(ra,2)+pow(da,2)) )
-    //             - ( pow(ra,2)/pow(pow(ra,2)+pow(da,2),1.5) )
-    //             + ( (n2_/n1_)/sqrt(pow(ra-rb,2)+pow(db,2)) )
-    //             - ( (n2_/n1_)*(ra-rb)*(2*ra-2*rb)/(2*pow(pow(ra-rb,2)+pow(db,2),1.5)) );
+void saRefocus::build_ref_lut(int cam) {
 
-    //         dfdrb = ( (n2_/n1_)*(ra-rb)*(2*ra-2*rb)/(2*pow(pow(ra-rb,2)+pow(db,2),1.5)) )
-    //             - ( (n2_/n1_)/sqrt(pow(ra-rb,2)+pow(db,2)) );
+    double c[3], g[5];
+    for (int i=0; i<3; i++)
+        c[i] = cam_locations_[cam].at<double>(0,i);
+    for (int i=0; i<5; i++)
+        g[i] = geom[i];
+
+    // Rays through the image corners in air have the largest slope of rays
+    // into the scene, which are bent towards the wall normal if n3 > n1. The
+    // margin covers points seen by other cameras and others are solved
+    // exactly.
+    Mat_<double> P;
+    P_mats_[cam].convertTo(P, CV_64F);
+    Mat_<double> Minv = P.colRange(0, 3).inv();
+    double s_max = 0;
+    for (int u=0; u<2; u++) {
+        for (int v=0; v<2; v++) {
+            Mat_<double> d = Minv*(Mat_<double>(3,1) << u*img_size_.width, v*img_size_.height, 1);
+            s_max = max(s_max, sqrt(d(0)*d(0) + d(1)*d(1))/fabs(d(2)));
+        }
+    }
 
-    //         dgdra = ( (ra-rb)*(2*ra-2*rb)/(2*pow(pow(ra-rb,2)+pow(db,2),1.5)) )
-    //             - ( (1.0)/sqrt(pow(ra-rb,2)+pow(db,2)) );
+    VLOG(1) << "Building refraction lookup table for camera " << cam;
+    ref_luts_[cam].build(c, g, 1.5*s_max, ref_lut_tol_);
 
-    //         dgdrb = ( (1.0)/sqrt(pow(ra-rb,2)+pow(db,2)) )
-    //             + ( (n3_/n2_)/sqrt(pow(rb-rp,2)+pow(dp,2)) )
-    //             - ( (ra-rb)*(2*ra-2*rb)/(2*pow(pow(ra-rb,2)+pow(db,2),1.5)) )
-    //             - ( (n3_/n2_)*(rb-rp)*(2*rb-2*rp)/(2*pow(pow(rb-rp,2)+pow(dp,2),1.5)) );
+}
 
-    //         ra = ra - ( (f*dgdrb - g*dfdrb)/(dfdra*dgdrb - dfdrb*dgdra) );
-    //         rb = rb - ( (g*dfdra - f*dgdra)/(dfdra*dgdrb - dfdrb*dgdra) );
+// Writes stacks handed over by dump_stack until the queue is closed
+static void write_stacks(boundedQueue<stack_job> *queue) {
 
-    //     }
+    stack_job job;
+    while (queue->pop(job)) {
+        imageIO io(job.path);
+        io<<job.stack;
+        VLOG(1) << "Wrote " << job.path;
+    }
 
-    //     a[0] = ra*cos(phi) + c[0];
-    //     a[1] = ra*sin(phi) + c[1];
+}
 
-    //     X_out(0,n) = a[0];
-    //     X_out(1,n) = a[1];
-    //     X_out(2,n) = a[2];
-    //     X_out(3,n) = 1.0;
+// Decodes all camera images of each frame ahead of dump_stack
+void saRefocus::decode_frames(boundedQueue<int> *queue) {
 
-    // }
+    for (int f=0; f<frames_.size(); f++) {
+        for (int i=0; i<num_cams_; i++)
+            get_view(i, f);
+        queue->push(f);
+    }
+    queue->close();
 
 }
 
@@ -1806,37 +4058,54 @@ void saRefocus::dump_stack(string path, double zmin, double zmax, double dz, dou
         mkdir(path.c_str(), S_IRWXU);
     }
 
+    // Frames go through a pipeline: camera images are decoded ahead of time
+    // (when frames are read lazily), volumes are refocused on all cores here
+    // and stacks are written by background threads. Queues are bounded so
+    // that at most a few frames are in flight.
+    boost::thread_group threads;
+
+    boundedQueue<int> decoded(2);
+    if (frame_cache_)
+        threads.create_thread(boost::bind(&saRefocus::decode_frames, this, &decoded));
+
+    const int num_writers = 2;
+    boundedQueue<stack_job> written(2);
+    for (int i=0; i<num_writers; i++)
+        threads.create_thread(boost::bind(&write_stacks, &written));
+
     for (int f=0; f<frames_.size(); f++) {
 
+        if (frame_cache_) {
+            int decoded_frame;
+            decoded.pop(decoded_frame);
+        }
+
+        stack_job job;
         stringstream fn;
         fn<<path<<stack_names_[frames_[f]];
         mkdir(fn.str().c_str(), S_IRWXU);
+        job.path = fn.str();
 
         LOG(INFO) << "Saving frame " << frames_.at(f) << " (" << fn.str() << ")...";
 
-        vector<Mat> stack;
+        // The GPU refocuses the frame uploaded into its first slot
+        int frame = f;
 #ifndef WITHOUT_CUDA
         if (GPU_FLAG) {
-            uploadSingleToGPU(f);            
-            for (double z=zmin; z<=zmax; z+=dz) {
-                Mat img = refocus(z, 0, 0, 0, thresh, 0);
-                stack.push_back(img);
-            }
+            uploadSingleToGPU(f);
+            frame = 0;
         }
 #endif
-        if (!GPU_FLAG) {
-            for (double z=zmin; z<=zmax; z+=dz) {
-                Mat img = refocus(z, 0, 0, 0, thresh, frames_[f]);
-                stack.push_back(img);
-            }
-        }
-
+        Mat volume = refocus_volume(zmin, zmax, dz, thresh, frame);
+        job.stack = get_planes(volume);
 
-        imageIO io(fn.str());
-        io<<stack; stack.clear();
+        written.push(job);
 
     }
 
+    written.close();
+    threads.join_all();
+
     LOG(INFO)<<"SAVING COMPLETE!"<<endl;
 
 }
@@ -1982,10 +4251,9 @@ void saRefocus::return_stack(double zmin, double zmax, double dz, double thresh,
 
     boost::chrono::system_clock::time_point t1 = boost::chrono::system_clock::now();
 
-    for (double z=zmin; z<=zmax+(dz*0.5); z+=dz) {
-        Mat img = refocus(z, 0, 0, 0, thresh, frame);
-        stack.push_back(img);
-    }
+    Mat volume = refocus_volume(zmin, zmax, dz, thresh, frame);
+    vector<Mat> planes = get_planes(volume);
+    stack.insert(stack.end(), planes.begin(), planes.end());
 
     boost::chrono::duration<double> t2 = boost::chrono::system_clock::now() - t1;
     VLOG(1)<<"Time taken for reconstruction: "<<t2;
@@ -1996,10 +4264,9 @@ void saRefocus::return_stack(double zmin, double zmax, double dz, double thresh,
 
     boost::chrono::system_clock::time_point t1 = boost::chrono::system_clock::now();
 
-    for (double z=zmin; z<=zmax; z+=dz) {
-        Mat img = refocus(z, 0, 0, 0, thresh, frame);
-        stack.push_back(img);
-    }
+    Mat volume = refocus_volume(zmin, zmax, dz, thresh, frame);
+    vector<Mat> planes = get_planes(volume);
+    stack.insert(stack.end(), planes.begin(), planes.end());
 
     boost::chrono::duration<double> t2 = boost::chrono::system_clock::now() - t1;
     time = t2.count();
@@ -2036,12 +4303,28 @@ double saRefocus::getQ(vector<Mat> &stack, vector<Mat> &refStack) {
 
 void saRefocus::threshold_image(Mat &img) {
 
-    // add code here and later replace for CPU functions
+    if (img.type() != CV_32F)
+        LOG(FATAL) << "Only CV_32F refocused images can be thresholded!";
+
+    if (STDEV_THRESH) {
+        vector<runningStats> stats(1);
+        for (int y=0; y<img.rows; y++)
+            stats[0].add(img.ptr<float>(y), img.cols);
+        vector<Mat> planes(1, img);
+        stdev_threshold(planes, stats, 1);
+    } else {
+        threshold(img, img, thresh_, 0, THRESH_TOZERO);
+    }
 
 }
 
 void saRefocus::saturate_images() {
 
+    if (frame_cache_) {
+        LOG(WARNING) << "Saturating images is not supported with lazy frame loading!";
+        return;
+    }
+
     LOG(INFO) << "Saturating images...";
 
     for (int i=0; i<imgs.size(); i++) {
@@ -2050,6 +4333,9 @@ void saRefocus::saturate_images() {
         }
     }
 
+    views_generation_++;
+    build_pyramids();
+
 }
 
 void saRefocus::saturate_image(Mat &img) {
@@ -2077,32 +4363,13 @@ void saRefocus::weight_images() {
             weight_image(imgs[i][j]);
         }
     }
+    views_generation_++;
 
 }
 
 void saRefocus::weight_image(Mat &img) {
 
-    Scalar mean_val = mean(img);
-    double min_val, max_val;
-    minMaxIdx(img, &min_val, &max_val);
-    if (max_val > 1.0)
-        LOG(WARNING) << "Maximum intensity (" << max_val << ") in image is larger than 1! This means images have not been saturated and final reconstruction will be affected.";
-
-    Mat ge_mask, lt_mask;
-    compare(img, mean_val, ge_mask, CMP_GE);
-    compare(img, mean_val, lt_mask, CMP_LT);
-    ge_mask.convertTo(ge_mask, CV_32F);
-    lt_mask.convertTo(lt_mask, CV_32F);
-    ge_mask /= 255.0;
-    if (weighting_mode_ == 1)
-        lt_mask *= -1.0*max_val/255.0;
-    else if (weighting_mode_ == 2)
-        lt_mask *= -1.0*num_cams_/255.0;
-    else
-        LOG(FATAL) << "Invalid weighting mode! Only options are 0, 1 and 2.";
-
-    multiply(img, ge_mask, img);
-    add(img, lt_mask, img);
+    weight_frame(img, weighting_mode_, num_cams_);
 
 }
 
@@ -2124,6 +4391,11 @@ void saRefocus::threshold_image(GpuMat &refocused) {
 
 void saRefocus::apply_preprocess(void (*preprocess_func)(Mat, Mat), string path) {
 
+    if (frame_cache_) {
+        LOG(WARNING) << "Preprocessing is not supported with lazy frame loading!";
+        return;
+    }
+
     if(imgs_read_) {
 
         vector<vector<Mat> > imgs_sub;
@@ -2139,6 +4411,8 @@ void saRefocus::apply_preprocess(void (*preprocess_func)(Mat, Mat), string path)
         }
         imgs.clear();
         imgs.swap(imgs_sub);
+        views_generation_++;
+        build_pyramids();
 
         VLOG(1)<<"done!\n";
 
@@ -2223,7 +4497,8 @@ void saRefocus::setBenchmarkMode(int flag) {
 
 void saRefocus::setIntImgMode(int flag) {
 
-    LOG(WARNING)<<"Integer image mode is ON now! Might break things in random places...";
+    if (flag)
+        LOG(WARNING)<<"Integer image mode is ON now! CPU refocusing keeps 8 and 16 bit images as is but GPU refocusing might break in random places...";
     INT_IMG_MODE = flag;
 
 }
@@ -2259,6 +4534,125 @@ void saRefocus::setStdevThresh(int flag) {
 
 }
 
+void saRefocus::setTileRows(int rows) {
+
+    if (rows < 1)
+        LOG(FATAL) << "Number of rows in a refocusing tile must be at least 1!";
+
+    tile_rows_ = rows;
+
+}
+
+void saRefocus::setROI(int x, int y, int width, int height) {
+
+    Rect roi = Rect(x, y, width, height) & Rect(Point(0, 0), img_size_);
+    if (!roi.area())
+        LOG(FATAL) << "Region of interest does not overlap image!";
+    if (roi.width != width || roi.height != height)
+        LOG(WARNING) << "Region of interest clipped to image (" << roi.x << ", " << roi.y << ", " << roi.width << ", " << roi.height << ")";
+
+    roi_ = roi;
+    VLOG(1) << "Refocusing region of interest " << roi_.x << ", " << roi_.y << ", " << roi_.width << ", " << roi_.height;
+
+}
+
+void saRefocus::setROIPhysical(double xmin, double xmax, double ymin, double ymax) {
+
+    if (D_.empty())
+        LOG(FATAL) << "Calibration data must be loaded before setting a physical region of interest!";
+
+    Mat_<double> D = D_;
+    double x1 = D(0,0)*xmin + D(0,2), x2 = D(0,0)*xmax + D(0,2);
+    double y1 = D(1,1)*ymin + D(1,2), y2 = D(1,1)*ymax + D(1,2);
+
+    int x = floor(std::min(x1, x2)), y = floor(std::min(y1, y2));
+    setROI(x, y, int(ceil(std::max(x1, x2))) - x + 1, int(ceil(std::max(y1, y2))) - y + 1);
+
+}
+
+void saRefocus::clearROI() {
+
+    roi_ = Rect();
+
+}
+
+Rect saRefocus::roi() {
+
+    if (roi_.area())
+        return roi_;
+    return Rect(Point(0, 0), img_size_);
+
+}
+
+void saRefocus::setMapCacheSize(double mb) {
+
+    map_cache_.setCapacity(mb);
+
+}
+
+void saRefocus::setMapCachePath(string path) {
+
+    map_cache_.setPath(path);
+
+}
+
+void saRefocus::setMapCacheCompact(int flag) {
+
+    map_cache_.setCompact(flag);
+
+}
+
+void saRefocus::setSparse(int flag) {
+
+    SPARSE_FLAG = flag;
+
+}
+
+void saRefocus::setVolumeThresh(int flag) {
+
+    VOLUME_THRESH = flag;
+
+}
+
+void saRefocus::setOverlapNorm(int flag) {
+
+    OVERLAP_NORM_FLAG = flag;
+
+}
+
+void saRefocus::setIncrementalTol(double tol) {
+
+    if (tol < 0)
+        LOG(FATAL) << "Incremental refocusing tolerance cannot be negative!";
+
+    incr_tol_ = tol;
+    incr_warps_.clear();
+    incr_Ms_.clear();
+
+}
+
+void saRefocus::setRefractionLUT(double tol) {
+
+    if (tol < 0)
+        LOG(FATAL) << "Refraction lookup table error bound cannot be negative!";
+
+    ref_lut_tol_ = tol;
+    ref_luts_.clear();
+    build_ref_luts();
+
+}
+
+void saRefocus::setRefMapInterp(double dz, double tol) {
+
+    if (dz > 0 && tol <= 0)
+        LOG(FATAL) << "Refractive map interpolation error bound must be positive!";
+
+    ref_map_dz_ = dz;
+    ref_map_tol_ = tol;
+    ref_lattice_dz_.clear();
+
+}
+
 void saRefocus::setArrayData(vector<Mat> imgs_sub, vector<Mat> Pmats, vector<Mat> cam_locations) {
 
     img_size_ = Size(imgs_sub[0].cols, imgs_sub[0].rows);
@@ -2278,6 +4672,8 @@ void saRefocus::setArrayData(vector<Mat> imgs_sub, vector<Mat> Pmats, vector<Mat
         imgs.push_back(sub);
 
     }
+    views_generation_++;
+    build_pyramids(imgs.size()-imgs_sub.size());
 
     cam_locations_ = cam_locations;
 
@@ -2301,6 +4697,9 @@ void saRefocus::updateHinv() {
     D_ = D;
     hinv_ = hinv;
 
+    hsweep_valid_ = 0;
+    views_generation_++;
+
 }
 
 void saRefocus::addView(Mat img, Mat P, Mat location) {
@@ -2312,6 +4711,8 @@ void saRefocus::addView(Mat img, Mat P, Mat location) {
 
     vector<Mat> sub; sub.push_back(img);
     imgs.push_back(sub);
+    views_generation_++;
+    build_pyramids(imgs.size()-1);
 
     cam_locations_.push_back(location);
 
@@ -2336,6 +4737,8 @@ void saRefocus::addViews(vector< vector<Mat> > frames, vector<Mat> Ps, vector<Ma
         }
         imgs.push_back(view);
     }
+    views_generation_++;
+    build_pyramids(imgs.size()-frames[0].size());
 
     // imgs = frames;
 
@@ -2353,6 +4756,9 @@ void saRefocus::clearViews() {
     imgs.clear();
     cam_locations_.clear();
     num_cams_ = 0;
+    hsweep_valid_ = 0;
+    views_generation_++;
+    build_pyramids();
 
 }
 
@@ -2375,8 +4781,8 @@ void saRefocus::setMult(int flag, double exp) {
 
 void saRefocus::setNlca(int flag, double delta) {
 
-    if (num_cams_ != 4)
-        LOG(FATAL) << "NLCA only supported for 4 cameras!";
+    if (GPU_FLAG && num_cams_ != 4)
+        LOG(FATAL) << "NLCA only supported for 4 cameras on the GPU!";
 
     nlca_ = flag;
     delta_ = delta;
@@ -2389,8 +4795,8 @@ void saRefocus::setNlca(int flag, double delta) {
 
 void saRefocus::setNlcaFast(int flag, double delta) {
 
-    if (num_cams_ != 4)
-        LOG(FATAL) << "NLCA (fast) only supported for 4 cameras!";
+    if (GPU_FLAG && num_cams_ != 4)
+        LOG(FATAL) << "NLCA (fast) only supported for 4 cameras on the GPU!";
 
     nlca_fast_ = flag;
     delta_ = delta;
@@ -2403,11 +4809,18 @@ void saRefocus::setNlcaFast(int flag, double delta) {
 
 void saRefocus::setNlcaWindow(int size) {
 
-    if ((img_size_.width % size != 0) && (img_size_.height % size != 0))
-        LOG(FATAL) << "Image size in both directions must be divible by NLCA window size!";
+    if (size < 1)
+        LOG(FATAL) << "NLCA window size must be positive!";
+
+    // The GPU kernel uses one thread block per window while the CPU uses a
+    // sliding window of any size
+    if (GPU_FLAG) {
+        if ((img_size_.width % size != 0) && (img_size_.height % size != 0))
+            LOG(FATAL) << "Image size in both directions must be divible by NLCA window size!";
 
-    if (size > 32)
-        LOG(FATAL) << "Window size greater than 32 not supported yet!";
+        if (size > 32)
+            LOG(FATAL) << "Window size greater than 32 not supported yet!";
+    }
 
     nlca_win_ = size;
 
@@ -2425,6 +4838,30 @@ void saRefocus::setRefractive(int ref, double zW, double n1, double n2, double n
     geom[0] = zW;
     geom[1] = n1; geom[2] = n2; geom[3] = n3;
     geom[4] = t;
+    build_ref_luts();
+
+}
+
+void saRefocus::setRefractiveLayers(vector<double> layers) {
+
+    if (layers.size() % 2)
+        LOG(FATAL) << "Refractive layers must be given as pairs of index and thickness!";
+    if (layers.size()/2 + 1 > REFRAC_MAX_LAYERS)
+        LOG(FATAL) << "At most " << REFRAC_MAX_LAYERS << " refractive layers including the wall are supported!";
+
+    ref_layers_ = layers;
+    build_ref_luts();
+
+}
+
+int saRefocus::ref_geom(double* g) {
+
+    for (int i=0; i<5; i++)
+        g[i] = geom[i];
+    for (int i=0; i<ref_layers_.size(); i++)
+        g[5+i] = ref_layers_[i];
+
+    return 1 + ref_layers_.size()/2;
 
 }
 
@@ -2440,6 +4877,8 @@ string saRefocus::showSettings() {
         s<<"n2: "<<geom[2]<<endl;
         s<<"n3: "<<geom[3]<<endl;
         s<<"Wall t: "<<geom[4]<<endl;
+        for (int i=0; i+1<ref_layers_.size(); i+=2)
+            s<<"Layer "<<i/2+2<<" n: "<<ref_layers_[i]<<", t: "<<ref_layers_[i+1]<<endl;
     }
     s<<"HF Method:\t"<<CORNER_FLAG<<endl;
     s<<"Multiplicative:\t"<<mult_<<endl;
@@ -2487,11 +4926,18 @@ BOOST_PYTHON_MODULE(refocusing) {
         .def("setMult", &saRefocus::setMult)
         .def("setHF", &saRefocus::setHF)
         .def("setRefractive", &saRefocus::setRefractive)
+        .def("setGpuMode", &saRefocus::setGpuMode)
         .def("showSettings", &saRefocus::showSettings)
 #ifndef WITHOUT_CUDA
         .def("initializeGPU", &saRefocus::initializeGPU, "@DocString(initializeGPU)")
 #endif
 	.def("refocus", &saRefocus::refocus, "@DocString(refocus)")
+        .def("refocus_into", &saRefocus::refocus_into, "@DocString(refocus_into)")
+        .def("refocus_volume", &saRefocus::refocus_volume, "@DocString(refocus_volume)")
+        .def("refocus_planes", &saRefocus::refocus_planes, "@DocString(refocus_planes)")
+        .def("setROI", &saRefocus::setROI, "@DocString(setROI)")
+        .def("setROIPhysical", &saRefocus::setROIPhysical, "@DocString(setROIPhysical)")
+        .def("clearROI", &saRefocus::clearROI, "@DocString(clearROI)")
         .def("project_point", &saRefocus::project_point)
         .def("getP", &saRefocus::getP)
         .def("getC", &saRefocus::getC)
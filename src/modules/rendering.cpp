@@ -34,6 +34,7 @@
 
 #include "rendering.h"
 #include "tools.h"
+#include "refraction.h"
 
 using namespace std;
 using namespace cv;
@@ -113,6 +114,18 @@ void Scene::setRefractiveGeom(float zW, float n1, float n2, float n3, float t) {
 
 }
 
+void Scene::setRefractiveLayers(vector<float> layers) {
+
+    if (layers.size() % 2)
+        LOG(FATAL) << "Refractive layers must be given as pairs of index and thickness!";
+    if (layers.size()/2 + 1 > REFRAC_MAX_LAYERS)
+        LOG(FATAL) << "At most " << REFRAC_MAX_LAYERS << " refractive layers including the wall are supported!";
+
+    geom_.resize(5);
+    geom_.insert(geom_.end(), layers.begin(), layers.end());
+
+}
+
 void Scene::seedR() {
 
     LOG(INFO)<<"Seeding R...";
@@ -881,76 +894,20 @@ void Camera::project() {
 
 void Camera::img_refrac(Mat_<double> Xcam, Mat_<double> X, Mat_<double> &X_out) {
 
-    float zW_ = geom_[0]; float n1_ = geom_[1]; float n2_ = geom_[2]; float n3_ = geom_[3]; float t_ = geom_[4];
-
-    double c[3];
+    // geom_ holds the wall followed by any further layers
+    double c[3], g[REFRAC_GEOM_SIZE(REFRAC_MAX_LAYERS)];
     for (int i=0; i<3; i++)
         c[i] = Xcam.at<double>(i,0);
+    for (int i=0; i<geom_.size(); i++)
+        g[i] = geom_[i];
+    int layers = (geom_.size() - 3)/2;
 
-    for (int n=0; n<X.cols; n++) {
-
-        double a[3];
-        double b[3];
-        double point[3];
-        for (int i=0; i<3; i++)
-            point[i] = X(i,n);
-
-        a[0] = c[0] + (point[0]-c[0])*(zW_-c[2])/(point[2]-c[2]);
-        a[1] = c[1] + (point[1]-c[1])*(zW_-c[2])/(point[2]-c[2]);
-        a[2] = zW_;
-        b[0] = c[0] + (point[0]-c[0])*(t_+zW_-c[2])/(point[2]-c[2]);
-        b[1] = c[1] + (point[1]-c[1])*(t_+zW_-c[2])/(point[2]-c[2]);
-        b[2] = t_+zW_;
-
-        double rp = sqrt( pow(point[0]-c[0],2) + pow(point[1]-c[1],2) );
-        double dp = point[2]-b[2];
-        double phi = atan2(point[1]-c[1],point[0]-c[0]);
-
-        double ra = sqrt( pow(a[0]-c[0],2) + pow(a[1]-c[1],2) );
-        double rb = sqrt( pow(b[0]-c[0],2) + pow(b[1]-c[1],2) );
-        double da = a[2]-c[2];
-        double db = b[2]-a[2];
-
-        double f, g, dfdra, dfdrb, dgdra, dgdrb;
-
-        // Newton Raphson loop to solve for Snell's law
-        double tol=1E-8;
-
-        for (int i=0; i<10; i++) {
-
-            f = ( ra/sqrt(pow(ra,2)+pow(da,2)) ) - ( (n2_/n1_)*(rb-ra)/sqrt(pow(rb-ra,2)+pow(db,2)) );
-            g = ( (rb-ra)/sqrt(pow(rb-ra,2)+pow(db,2)) ) - ( (n3_/n2_)*(rp-rb)/sqrt(pow(rp-rb,2)+pow(dp,2)) );
-
-            dfdra = ( (1.0)/sqrt(pow(ra,2)+pow(da,2)) )
-                - ( pow(ra,2)/pow(pow(ra,2)+pow(da,2),1.5) )
-                + ( (n2_/n1_)/sqrt(pow(ra-rb,2)+pow(db,2)) )
-                - ( (n2_/n1_)*(ra-rb)*(2*ra-2*rb)/(2*pow(pow(ra-rb,2)+pow(db,2),1.5)) );
-
-            dfdrb = ( (n2_/n1_)*(ra-rb)*(2*ra-2*rb)/(2*pow(pow(ra-rb,2)+pow(db,2),1.5)) )
-                - ( (n2_/n1_)/sqrt(pow(ra-rb,2)+pow(db,2)) );
-
-            dgdra = ( (ra-rb)*(2*ra-2*rb)/(2*pow(pow(ra-rb,2)+pow(db,2),1.5)) )
-                - ( (1.0)/sqrt(pow(ra-rb,2)+pow(db,2)) );
-
-            dgdrb = ( (1.0)/sqrt(pow(ra-rb,2)+pow(db,2)) )
-                + ( (n3_/n2_)/sqrt(pow(rb-rp,2)+pow(dp,2)) )
-                - ( (ra-rb)*(2*ra-2*rb)/(2*pow(pow(ra-rb,2)+pow(db,2),1.5)) )
-                - ( (n3_/n2_)*(rb-rp)*(2*rb-2*rp)/(2*pow(pow(rb-rp,2)+pow(dp,2),1.5)) );
-
-            ra = ra - ( (f*dgdrb - g*dfdrb)/(dfdra*dgdrb - dfdrb*dgdra) );
-            rb = rb - ( (g*dfdra - f*dgdra)/(dfdra*dgdrb - dfdrb*dgdra) );
-
-        }
-
-        a[0] = ra*cos(phi) + c[0];
-        a[1] = ra*sin(phi) + c[1];
-
-        X_out(0,n) = a[0];
-        X_out(1,n) = a[1];
-        X_out(2,n) = a[2];
-        X_out(3,n) = 1.0;
-
-    }
+    if (layers > 1)
+        refract_layers(c, g, layers, X[0], X[1], X[2], X_out[0], X_out[1], X.cols);
+    else
+        refract_points(c, g, X[0], X[1], X[2], X_out[0], X_out[1], X.cols);
+    X_out.row(2).setTo(geom_[0]);
+    X_out.row(3).setTo(1.0);
 
 }
 
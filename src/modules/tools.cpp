@@ -22,6 +22,13 @@
 // OpenFV. If not, see https://www.gnu.org/licenses/old-licenses/gpl-2.0.en.html.
 
 #include "tools.h"
+#include "refraction.h"
+
+#if defined __AVX__
+#include <immintrin.h>
+#elif defined __SSE2__
+#include <emmintrin.h>
+#endif
 
 using namespace std;
 using namespace cv;
@@ -1044,6 +1051,609 @@ Mat mtiffReader::get_frame(int n) {
 
 }
 
+void convert_frame(Mat &img, int keep_8bit, int keep_16bit, bool verbose) {
+
+    Mat img2;
+    switch(img.type()) {
+
+    case CV_8U:
+        if (keep_8bit)
+            break;
+        if (verbose)
+            VLOG(3)<<"Converting images from CV_8U type to CV_32F type...";
+        img.convertTo(img2, CV_32F);
+        img2 /= 255.0;
+        img = img2;
+        break;
+
+    case CV_16U:
+        if (keep_16bit)
+            break;
+        if (verbose)
+            VLOG(3)<<"Converting images from CV_16U type to CV_32F type...";
+        img.convertTo(img2, CV_32F);
+        img2 /= 65535.0;
+        img = img2;
+        break;
+
+    case CV_32F:
+        if (verbose)
+            VLOG(3)<<"Images already CV_32F type...";
+        break;
+
+    case CV_64F:
+        if (verbose)
+            VLOG(3)<<"Converting images from CV_64F type to CV_32F type...";
+        img.convertTo(img2, CV_32F);
+        img = img2;
+        break;
+
+    }
+
+}
+
+void weight_frame(Mat &img, int mode, int num_cams) {
+
+    Scalar mean_val = mean(img);
+    double min_val, max_val;
+    minMaxIdx(img, &min_val, &max_val);
+    if (max_val > 1.0)
+        LOG(WARNING) << "Maximum intensity (" << max_val << ") in image is larger than 1! This means images have not been saturated and final reconstruction will be affected.";
+
+    Mat ge_mask, lt_mask;
+    compare(img, mean_val, ge_mask, CMP_GE);
+    compare(img, mean_val, lt_mask, CMP_LT);
+    ge_mask.convertTo(ge_mask, CV_32F);
+    lt_mask.convertTo(lt_mask, CV_32F);
+    ge_mask /= 255.0;
+    if (mode == 1)
+        lt_mask *= -1.0*max_val/255.0;
+    else if (mode == 2)
+        lt_mask *= -1.0*num_cams/255.0;
+    else
+        LOG(FATAL) << "Invalid weighting mode! Only options are 0, 1 and 2.";
+
+    multiply(img, ge_mask, img);
+    add(img, lt_mask, img);
+
+}
+
+// Lanes of points processed together by the refraction solver. Each lane
+// type wraps a register type supporting + - * / and refrac_sqrt and provides
+// loads, stores and a guarded reciprocal.
+template<typename T>
+struct scalarLanes {
+    typedef T V;
+    enum { N = 1 };
+    static V set(T a) { return a; }
+    static V load(const T* p) { return *p; }
+    static void store(T* p, V a) { *p = a; }
+    static V rcp_or_zero(V a) { return a != 0 ? 1/a : 0; }
+    static bool all_below(V a, T b) { return std::abs(a) < b; }
+};
+
+#if defined __AVX__ || defined __SSE2__
+
+#if defined __AVX__
+#define SIMD_PD __m256d
+#define SIMD_PS __m256
+#define SIMD_OP(op, t) _mm256_##op##_##t
+#else
+#define SIMD_PD __m128d
+#define SIMD_PS __m128
+#define SIMD_OP(op, t) _mm_##op##_##t
+#endif
+
+#define SIMD_LANES(name, reg, t, T)                                     \
+    struct name##V {                                                    \
+        reg v;                                                          \
+        name##V() {}                                                    \
+        name##V(reg a): v(a) {}                                         \
+        name##V(T a): v(SIMD_OP(set1, t)(a)) {}                         \
+        name##V operator+(name##V b) const { return SIMD_OP(add, t)(v, b.v); } \
+        name##V operator-(name##V b) const { return SIMD_OP(sub, t)(v, b.v); } \
+        name##V operator*(name##V b) const { return SIMD_OP(mul, t)(v, b.v); } \
+        name##V operator/(name##V b) const { return SIMD_OP(div, t)(v, b.v); } \
+    };                                                                  \
+    struct name {                                                       \
+        typedef name##V V;                                              \
+        enum { N = sizeof(reg)/sizeof(T) };                             \
+        static V set(T a) { return SIMD_OP(set1, t)(a); }               \
+        static V load(const T* p) { return SIMD_OP(loadu, t)(p); }      \
+        static void store(T* p, V a) { SIMD_OP(storeu, t)(p, a.v); }    \
+        static V rcp_or_zero(V a) {                                     \
+            reg zero = SIMD_OP(setzero, t)();                           \
+            return SIMD_OP(andnot, t)(CMPEQ_##t(a.v, zero), SIMD_OP(div, t)(SIMD_OP(set1, t)(1), a.v)); \
+        }                                                               \
+        static bool all_below(V a, T b) {                               \
+            reg abs = SIMD_OP(andnot, t)(SIMD_OP(set1, t)(-0.0), a.v);  \
+            return SIMD_OP(movemask, t)(CMPLT_##t(abs, SIMD_OP(set1, t)(b))) == (1<<N)-1; \
+        }                                                               \
+    };                                                                  \
+    inline name##V refrac_sqrt(name##V a) { return SIMD_OP(sqrt, t)(a.v); }
+
+#if defined __AVX__
+#define CMPEQ_pd(a, b) _mm256_cmp_pd(a, b, _CMP_EQ_OQ)
+#define CMPEQ_ps(a, b) _mm256_cmp_ps(a, b, _CMP_EQ_OQ)
+#define CMPLT_pd(a, b) _mm256_cmp_pd(a, b, _CMP_LT_OQ)
+#define CMPLT_ps(a, b) _mm256_cmp_ps(a, b, _CMP_LT_OQ)
+#else
+#define CMPEQ_pd(a, b) _mm_cmpeq_pd(a, b)
+#define CMPEQ_ps(a, b) _mm_cmpeq_ps(a, b)
+#define CMPLT_pd(a, b) _mm_cmplt_pd(a, b)
+#define CMPLT_ps(a, b) _mm_cmplt_ps(a, b)
+#endif
+
+SIMD_LANES(simdLanesD, SIMD_PD, pd, double)
+SIMD_LANES(simdLanesF, SIMD_PS, ps, float)
+
+#undef SIMD_LANES
+#undef CMPEQ_pd
+#undef CMPEQ_ps
+#undef CMPLT_pd
+#undef CMPLT_ps
+#undef SIMD_OP
+#undef SIMD_PD
+#undef SIMD_PS
+
+#endif
+
+template<typename L, typename T>
+static inline void refract_lanes(const T c[3], const T geom[5], int iters, const T* x, const T* y, const T* z, T* ax, T* ay) {
+
+    typedef typename L::V V;
+
+    V cx = L::set(c[0]), cy = L::set(c[1]), cz = L::set(c[2]);
+    V zW = L::set(geom[0]), tw = L::set(geom[4]);
+    V k1 = L::set(geom[2]/geom[1]), k2 = L::set(geom[3]/geom[2]);
+
+    V dx = L::load(x) - cx, dy = L::load(y) - cy, dz = L::load(z) - cz;
+    V rp = refrac_sqrt(dx*dx + dy*dy);
+    V da = zW - cz;
+
+    V ra, rb, f, g;
+    refrac_initial_guess(rp, dz, da, tw, ra, rb);
+    refrac_solve(rp, da, tw, dz - da - tw, k1, k2, ra, rb, iters, f, g);
+
+    V r = ra*L::rcp_or_zero(rp);
+    L::store(ax, cx + dx*r);
+    L::store(ay, cy + dy*r);
+
+}
+
+// Same as refract_lanes but iterates until the Newton updates of all lanes
+// are below step_tol. If seeded, ra and rb start from the ratios qa = ra/rp and
+// qb = rb/rp of nearby points, which are replaced by the ratios of the
+// solution. Returns the number of iterations.
+template<typename L, typename T>
+static inline int refract_lanes_warm(const T c[3], const T geom[5], T step_tol, int max_iters, bool seeded, const T* x, const T* y, const T* z, T* ax, T* ay, T* qa, T* qb) {
+
+    typedef typename L::V V;
+
+    V cx = L::set(c[0]), cy = L::set(c[1]), cz = L::set(c[2]);
+    V zW = L::set(geom[0]), tw = L::set(geom[4]);
+    V k1 = L::set(geom[2]/geom[1]), k2 = L::set(geom[3]/geom[2]);
+
+    V dx = L::load(x) - cx, dy = L::load(y) - cy, dz = L::load(z) - cz;
+    V rp = refrac_sqrt(dx*dx + dy*dy);
+    V da = zW - cz, dp = dz - da - tw;
+
+    V ra, rb, f, g;
+    if (seeded) {
+        ra = L::load(qa)*rp;
+        rb = L::load(qb)*rp;
+    } else {
+        refrac_initial_guess(rp, dz, da, tw, ra, rb);
+    }
+
+    V da2 = da*da, db2 = tw*tw, dp2 = dp*dp;
+    int iters = 0;
+    while (iters < max_iters) {
+        V ra0 = ra, rb0 = rb;
+        refrac_newton_step(rp, da2, db2, dp2, k1, k2, ra, rb, f, g);
+        iters++;
+        if (L::all_below(ra - ra0, step_tol) && L::all_below(rb - rb0, step_tol))
+            break;
+    }
+
+    V irp = L::rcp_or_zero(rp);
+    L::store(qa, ra*irp);
+    L::store(qb, rb*irp);
+    V r = ra*irp;
+    L::store(ax, cx + dx*r);
+    L::store(ay, cy + dy*r);
+
+    return iters;
+
+}
+
+void refract_points(const double c[3], const double geom[5], const double* x, const double* y, const double* z, double* ax, double* ay, int n, int iters) {
+
+    int i = 0;
+#if defined __AVX__ || defined __SSE2__
+    for (; i+simdLanesD::N<=n; i+=simdLanesD::N)
+        refract_lanes<simdLanesD>(c, geom, iters, x+i, y+i, z+i, ax+i, ay+i);
+#endif
+    for (; i<n; i++)
+        refract_lanes< scalarLanes<double> >(c, geom, iters, x+i, y+i, z+i, ax+i, ay+i);
+
+}
+
+void refract_points(const float c[3], const float geom[5], const float* x, const float* y, const float* z, float* ax, float* ay, int n, int iters) {
+
+    int i = 0;
+#if defined __AVX__ || defined __SSE2__
+    for (; i+simdLanesF::N<=n; i+=simdLanesF::N)
+        refract_lanes<simdLanesF>(c, geom, iters, x+i, y+i, z+i, ax+i, ay+i);
+#endif
+    for (; i<n; i++)
+        refract_lanes< scalarLanes<float> >(c, geom, iters, x+i, y+i, z+i, ax+i, ay+i);
+
+}
+
+template<typename L, typename T>
+static inline void refract_layers_lanes(const T c[3], T zW, const refracLayers<typename L::V> &S, int iters, const T* x, const T* y, const T* z, T* ax, T* ay) {
+
+    typedef typename L::V V;
+
+    V cx = L::set(c[0]), cy = L::set(c[1]), cz = L::set(c[2]);
+
+    V dx = L::load(x) - cx, dy = L::load(y) - cy, dz = L::load(z) - cz;
+    V rp = refrac_sqrt(dx*dx + dy*dy);
+    V da = L::set(zW) - cz;
+
+    V ra = refrac_layers_solve(S, rp, da, dz - da - S.depth, iters);
+
+    V r = ra*L::rcp_or_zero(rp);
+    L::store(ax, cx + dx*r);
+    L::store(ay, cy + dy*r);
+
+}
+
+void refract_layers(const double c[3], const double* geom, int layers, const double* x, const double* y, const double* z, double* ax, double* ay, int n, int iters) {
+
+    if (layers < 1 || layers > REFRAC_MAX_LAYERS)
+        LOG(FATAL) << "Number of refractive layers must be between 1 and " << REFRAC_MAX_LAYERS << "!";
+
+    int i = 0;
+#if defined __AVX__ || defined __SSE2__
+    refracLayers<simdLanesD::V> SV;
+    refrac_layers_setup(geom, layers, SV);
+    for (; i+simdLanesD::N<=n; i+=simdLanesD::N)
+        refract_layers_lanes<simdLanesD>(c, geom[0], SV, iters, x+i, y+i, z+i, ax+i, ay+i);
+#endif
+    refracLayers<double> S;
+    refrac_layers_setup(geom, layers, S);
+    for (; i<n; i++)
+        refract_layers_lanes< scalarLanes<double> >(c, geom[0], S, iters, x+i, y+i, z+i, ax+i, ay+i);
+
+}
+
+void refract_layers(const float c[3], const float* geom, int layers, const float* x, const float* y, const float* z, float* ax, float* ay, int n, int iters) {
+
+    if (layers < 1 || layers > REFRAC_MAX_LAYERS)
+        LOG(FATAL) << "Number of refractive layers must be between 1 and " << REFRAC_MAX_LAYERS << "!";
+
+    int i = 0;
+#if defined __AVX__ || defined __SSE2__
+    refracLayers<simdLanesF::V> SV;
+    refrac_layers_setup(geom, layers, SV);
+    for (; i+simdLanesF::N<=n; i+=simdLanesF::N)
+        refract_layers_lanes<simdLanesF>(c, geom[0], SV, iters, x+i, y+i, z+i, ax+i, ay+i);
+#endif
+    refracLayers<float> S;
+    refrac_layers_setup(geom, layers, S);
+    for (; i<n; i++)
+        refract_layers_lanes< scalarLanes<float> >(c, geom[0], S, iters, x+i, y+i, z+i, ax+i, ay+i);
+
+}
+
+void runningStats::add(const float* values, int len) {
+
+    if (len <= 0)
+        return;
+
+    // Statistics of the block itself are calculated around its own mean
+    // and then merged, which keeps the sums of squares small
+    runningStats block;
+    double sum = 0;
+    for (int i=0; i<len; i++)
+        sum += values[i];
+    block.n_ = len;
+    block.mean_ = sum/len;
+    for (int i=0; i<len; i++) {
+        double d = values[i] - block.mean_;
+        block.m2_ += d*d;
+    }
+
+    merge(block);
+
+}
+
+void runningStats::add(double value, double count) {
+
+    runningStats block;
+    block.n_ = count;
+    block.mean_ = value;
+    merge(block);
+
+}
+
+void runningStats::merge(const runningStats &stats) {
+
+    if (stats.n_ <= 0)
+        return;
+    if (n_ <= 0) {
+        *this = stats;
+        return;
+    }
+
+    double n = n_ + stats.n_;
+    double d = stats.mean_ - mean_;
+    mean_ += d*stats.n_/n;
+    m2_ += stats.m2_ + d*d*n_*stats.n_/n;
+    n_ = n;
+
+}
+
+void refract_grid(const double c[3], const double geom[5], const double* x, const double* y, const double* z, double* ax, double* ay, int rows, int cols, double tol, int max_iters, refracStats* stats) {
+
+    // Ratios ra/rp and rb/rp of the solutions in the previous row
+    vector<double> qa(cols), qb(cols);
+
+    // Newton's method converges quadratically and an update of size d leaves
+    // an error of about d^2/da, so iterations stop at updates of sqrt(tol*da)
+    double step_tol = sqrt(tol*fabs(geom[0]-c[2]));
+
+    refracStats st;
+    for (int r=0; r<rows; r++) {
+
+        bool seeded = r > 0;
+        int o = r*cols;
+        int i = 0;
+#if defined __AVX__ || defined __SSE2__
+        for (; i+simdLanesD::N<=cols; i+=simdLanesD::N) {
+            int it = refract_lanes_warm<simdLanesD>(c, geom, step_tol, max_iters, seeded, x+o+i, y+o+i, z+o+i, ax+o+i, ay+o+i, &qa[i], &qb[i]);
+            st.add(it, simdLanesD::N);
+        }
+#endif
+        for (; i<cols; i++) {
+            int it = refract_lanes_warm< scalarLanes<double> >(c, geom, step_tol, max_iters, seeded, x+o+i, y+o+i, z+o+i, ax+o+i, ay+o+i, &qa[i], &qb[i]);
+            st.add(it, 1);
+        }
+
+    }
+
+    if (stats)
+        *stats = st;
+
+}
+
+void cubic_weights(double t, double w[4]) {
+
+    w[0] = -t*(t-1)*(t-2)/6.0;
+    w[1] = (t+1)*(t-1)*(t-2)/2.0;
+    w[2] = -(t+1)*t*(t-2)/2.0;
+    w[3] = (t+1)*t*(t-1)/6.0;
+
+}
+
+Mat scratchArena::get(int rows, int cols, int type) {
+
+    size_t need = size_t(rows)*cols*CV_ELEM_SIZE(type);
+
+    if (next_ == bufs_.size())
+        bufs_.push_back(Mat());
+
+    // Buffers only ever grow so a repeated sequence of requests settles
+    Mat &buf = bufs_[next_++];
+    if (size_t(buf.cols) < need) {
+        VLOG(3)<<"Growing scratch buffer "<<next_-1<<" to "<<need<<" bytes";
+        buf.create(1, need, CV_8U);
+    }
+
+    return Mat(rows, cols, type, buf.data);
+
+}
+
+size_t scratchArena::bytes() const {
+
+    size_t total = 0;
+    for (int i=0; i<bufs_.size(); i++)
+        total += bufs_[i].cols;
+    return total;
+
+}
+
+imageFolderSource::imageFolderSource(vector< vector<string> > names, vector<Mat> K_mats, vector<Mat> dist_coeffs, int undistort):
+    names_(names), K_mats_(K_mats), dist_coeffs_(dist_coeffs), undistort_(undistort) {}
+
+Mat imageFolderSource::get_frame(int cam, int frame) {
+
+    VLOG(3)<<"Decoding "<<names_[cam].at(frame);
+    Mat image = imread(names_[cam].at(frame), 0);
+    if (image.empty())
+        LOG(FATAL) << "Could not read " << names_[cam][frame] << "!";
+
+    if (undistort_) {
+        Mat image2;
+        fisheye::undistortImage(image, image2, K_mats_[cam], dist_coeffs_[cam], K_mats_[cam]);
+        return(image2);
+    }
+
+    return(image);
+
+}
+
+mtiffSource::mtiffSource(vector<mtiffReader> tiffs, vector<int> frames):
+    tiffs_(tiffs), frames_(frames) {}
+
+Mat mtiffSource::get_frame(int cam, int frame) {
+
+    boost::lock_guard<boost::mutex> lock(mutex_);
+    return(tiffs_[cam].get_frame(frames_.at(frame)));
+
+}
+
+frameCache::frameCache(frameSource* source, int num_cams, double mb, int prefetch):
+    source_(source), num_cams_(num_cams), capacity_(size_t(mb*1024*1024)), used_(0), prefetch_(prefetch), keep_8bit_(0), keep_16bit_(0), weighting_mode_(0), clock_(0), generation_(0), stop_(false) {
+
+    if (prefetch_ > 0)
+        worker_ = boost::thread(&frameCache::run, this);
+
+}
+
+frameCache::~frameCache() {
+
+    {
+        boost::lock_guard<boost::mutex> lock(mutex_);
+        stop_ = true;
+    }
+    cond_.notify_all();
+    if (worker_.joinable())
+        worker_.join();
+
+}
+
+void frameCache::setConversion(int keep_8bit, int keep_16bit, int weighting_mode) {
+
+    boost::lock_guard<boost::mutex> lock(mutex_);
+    keep_8bit_ = keep_8bit;
+    keep_16bit_ = keep_16bit;
+    weighting_mode_ = weighting_mode;
+    entries_.clear();
+    used_ = 0;
+    // Frames being decoded right now used the old conversion
+    generation_++;
+
+}
+
+Mat frameCache::get(int cam, int frame, int level) {
+
+    frame_key key(cam, frame, level);
+    boost::unique_lock<boost::mutex> lock(mutex_);
+
+    schedule(frame);
+
+    while (1) {
+        std::map<frame_key, frame_entry>::iterator it = entries_.find(key);
+        if (it != entries_.end()) {
+            it->second.last_used = clock_++;
+            return(it->second.img);
+        }
+        // Wait for the background thread if it is already decoding this frame
+        if (!pending_.count(key))
+            break;
+        cond_.wait(lock);
+    }
+
+    pending_.insert(key);
+    int generation = generation_;
+    int keep_8bit = keep_8bit_, keep_16bit = keep_16bit_, weighting_mode = weighting_mode_;
+    lock.unlock();
+    Mat img;
+    if (level > 0)
+        pyrDown(get(cam, frame, level-1), img);
+    else
+        img = load(key, keep_8bit, keep_16bit, weighting_mode);
+    lock.lock();
+    pending_.erase(key);
+    if (generation == generation_)
+        insert(key, img);
+    cond_.notify_all();
+
+    return(img);
+
+}
+
+Mat frameCache::load(frame_key key, int keep_8bit, int keep_16bit, int weighting_mode) {
+
+    Mat img = source_->get_frame(key.cam, key.frame);
+    convert_frame(img, keep_8bit, keep_16bit);
+    if (weighting_mode > 0)
+        weight_frame(img, weighting_mode, num_cams_);
+
+    return(img);
+
+}
+
+void frameCache::insert(frame_key key, Mat img) {
+
+    size_t bytes = img.total()*img.elemSize();
+
+    // Evict least recently used frames until the new one fits. Frames that
+    // are still in use elsewhere stay alive until released.
+    while (!entries_.empty() && used_ + bytes > capacity_) {
+        std::map<frame_key, frame_entry>::iterator lru = entries_.begin();
+        for (std::map<frame_key, frame_entry>::iterator it = entries_.begin(); it != entries_.end(); ++it) {
+            if (it->second.last_used < lru->second.last_used)
+                lru = it;
+        }
+        used_ -= lru->second.img.total()*lru->second.img.elemSize();
+        entries_.erase(lru);
+    }
+
+    if (used_ + bytes > capacity_)
+        return;
+
+    frame_entry entry;
+    entry.img = img;
+    entry.last_used = clock_++;
+    entries_[key] = entry;
+    used_ += bytes;
+
+}
+
+// Queues frames following frame for prefetching (mutex must be held)
+void frameCache::schedule(int frame) {
+
+    if (prefetch_ < 1)
+        return;
+
+    for (int f=frame+1; f<=frame+prefetch_ && f<num_frames(); f++) {
+        for (int i=0; i<num_cams_; i++) {
+            frame_key key(i, f);
+            if (!entries_.count(key) && !pending_.count(key) && std::find(queue_.begin(), queue_.end(), key) == queue_.end())
+                queue_.push_back(key);
+        }
+    }
+    cond_.notify_all();
+
+}
+
+void frameCache::run() {
+
+    boost::unique_lock<boost::mutex> lock(mutex_);
+
+    while (!stop_) {
+
+        if (queue_.empty()) {
+            cond_.wait(lock);
+            continue;
+        }
+
+        frame_key key = queue_.front();
+        queue_.pop_front();
+        if (entries_.count(key) || pending_.count(key))
+            continue;
+
+        // Conversion settings are read under the lock since setConversion can
+        // change them while the frame is decoded
+        pending_.insert(key);
+        int generation = generation_;
+        int keep_8bit = keep_8bit_, keep_16bit = keep_16bit_, weighting_mode = weighting_mode_;
+        lock.unlock();
+        Mat img = load(key, keep_8bit, keep_16bit, weighting_mode);
+        lock.lock();
+        pending_.erase(key);
+        if (generation == generation_)
+            insert(key, img);
+        cond_.notify_all();
+
+    }
+
+}
+
 mp4Reader::mp4Reader(string path) {
 
     path_ = path;
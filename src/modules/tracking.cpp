@@ -41,6 +41,7 @@ pLocalize::pLocalize(localizer_settings s, saRefocus refocus, refocus_settings s
     window_(s.window), zmin_(s.zmin), zmax_(s.zmax), dz_(s.dz), thresh_(s.thresh), zmethod_(s.zmethod), refocus_(refocus), s2_(s2), show_particles_(s.show_particles), show_refocused_(s.show_refocused), cluster_size_(s.cluster_size) {
 
     zext_ = 2.5;
+    coarse_level_ = 0;
 
     //cout<<"Crit cluster size: "<<cluster_size_<<endl;
 
@@ -73,15 +74,36 @@ void pLocalize::find_particles_3d(int frame) {
     vector<Point2f> points, points2;
     vector<particle2d> particles;
 
-    double rx = 0; double ry = 0; double rz = 0;
-
     VLOG(2)<<"Searching for particles through volume at frame "<<frame<<"..."<<endl;
 
-    for (float i=zmin_; i<=zmax_; i += dz_) {
+    // Whole volume is refocused at once and then searched plane by plane
+    vector<double> zs;
+    vector<Mat> planes;
+    if (coarse_level_) {
+        coarse_depths(frame, zs);
+        if (zs.size()) {
+            Mat_<double> poses = Mat_<double>::zeros(zs.size(), 4);
+            for (int k=0; k<zs.size(); k++) {
+                poses(k,2) = 1;
+                poses(k,3) = zs[k];
+            }
+            planes = refocus_.get_planes(refocus_.refocus_planes(poses, thresh_, frame));
+        }
+    } else {
+        planes = refocus_.get_planes(refocus_.refocus_volume(zmin_, zmax_, dz_, thresh_, frame));
+        for (int k=0; k<planes.size(); k++)
+            zs.push_back(zmin_ + k*dz_);
+    }
+
+    // Planes only cover the refocusing region of interest if one is set
+    Rect roi = refocus_.roi();
+
+    for (int k=0; k<planes.size(); k++) {
 
+        double i = zs[k];
         VLOG(3)<<1+int((i-zmin_)*100.0/(zmax_-zmin_))<<"%"<<flush;
 
-        Mat image = refocus_.refocus(i, rx, ry, rz, thresh_, frame);
+        Mat image = planes[k];
         if (show_refocused_) {
             qimshow(image);
         }
@@ -94,8 +116,8 @@ void pLocalize::find_particles_3d(int frame) {
         }
 
         for (int j=0; j<particles.size(); j++) {
-            particle.x = (particles[j].x - refocus_.img_size().width*0.5)/refocus_.scale();
-            particle.y = (particles[j].y - refocus_.img_size().height*0.5)/refocus_.scale();
+            particle.x = (particles[j].x + roi.x - refocus_.img_size().width*0.5)/refocus_.scale();
+            particle.y = (particles[j].y + roi.y - refocus_.img_size().height*0.5)/refocus_.scale();
             particle.z = i;
             particle.I = particles[j].I;
             particles3D_.push_back(particle);
@@ -116,6 +138,49 @@ void pLocalize::find_particles_3d(int frame) {
 
 }
 
+void pLocalize::setCoarseLevel(int level) {
+
+    if (level > refocus_.pyramid_levels())
+        refocus_.setPyramidLevels(level);
+    coarse_level_ = level;
+
+}
+
+// Refocuses the volume at pyramid level coarse_level_ and keeps the depths of
+// the full resolution sweep that are within zext_ of a plane in which
+// particles are found
+void pLocalize::coarse_depths(int frame, vector<double> &zs) {
+
+    int level = refocus_.pyramid_level();
+    refocus_.setPyramidLevel(coarse_level_);
+    Mat volume = refocus_.refocus_volume(zmin_, zmax_, dz_, thresh_, frame);
+    vector<Mat> planes = refocus_.get_planes(volume);
+    refocus_.setPyramidLevel(level);
+
+    vector<double> hits;
+    vector<Point2f> points;
+    for (int k=0; k<planes.size(); k++) {
+        find_particles(planes[k], points);
+        if (points.size())
+            hits.push_back(zmin_ + k*dz_);
+        points.clear();
+    }
+
+    zs.clear();
+    for (int k=0; k<planes.size(); k++) {
+        double z = zmin_ + k*dz_;
+        for (int j=0; j<hits.size(); j++) {
+            if (fabs(z - hits[j]) <= zext_) {
+                zs.push_back(z);
+                break;
+            }
+        }
+    }
+
+    VLOG(2)<<"Coarse search kept "<<zs.size()<<" of "<<planes.size()<<" depths"<<endl;
+
+}
+
 void pLocalize::z_resolution() {
 
     double zref = 5.0;
@@ -0,0 +1,188 @@
+#include "refocusing.h"
+
+using namespace cv;
+using namespace std;
+
+DEFINE_int32(grid, 5, "cameras per side of the square camera array");
+DEFINE_bool(gpu, false, "check GPUrefocus_ref instead of CPUrefocus_ref");
+DEFINE_double(proj_tol, 1e-3, "allowed project_point error in pixels");
+DEFINE_double(refocus_tol, 1e-2, "allowed refocused intensity error");
+
+// Synthetic array looking through a glass wall into water (all units in mm)
+static const double zW = -40, n1 = 1.0, n2 = 1.5, n3 = 1.33, t = 10;
+static const double f = 2, z0 = 5;
+static const int img_w = 320, img_h = 240;
+static const double fpx = 800;
+
+// Projection matrix of a camera at c looking at the origin
+static Mat camera_P(const Vec3d &c) {
+
+    Vec3d z = -c*(1/norm(c));
+    Vec3d x = Vec3d(0, 1, 0).cross(z); x *= 1/norm(x);
+    Vec3d y = z.cross(x);
+
+    Mat_<double> Rt(3, 4);
+    for (int j=0; j<3; j++) {
+        Rt(0,j) = x[j]; Rt(1,j) = y[j]; Rt(2,j) = z[j];
+    }
+    Rt(0,3) = -x.dot(c); Rt(1,3) = -y.dot(c); Rt(2,3) = -z.dot(c);
+
+    Mat_<double> K = (Mat_<double>(3,3) << fpx, 0, img_w*0.5, 0, fpx, img_h*0.5, 0, 0, 1);
+    return K*Rt;
+
+}
+
+// Point on the wall that the ray from c to p passes through, found by
+// bisection on the sine of the ray angle in air independently of the
+// Newton solver in refraction.h
+static Vec3d wall_point(const Vec3d &c, const Vec3d &p) {
+
+    double rp = sqrt((p[0]-c[0])*(p[0]-c[0]) + (p[1]-c[1])*(p[1]-c[1]));
+    double d[3] = {zW - c[2], t, p[2] - zW - t};
+    double n[3] = {n1, n2, n3};
+
+    double lo = 0, hi = 1;
+    for (int i=0; i<100; i++) {
+        double s1 = 0.5*(lo+hi), r = 0;
+        for (int k=0; k<3; k++) {
+            double s = s1*n1/n[k];
+            r += d[k]*s/sqrt(1-s*s);
+        }
+        if (r < rp)
+            lo = s1;
+        else
+            hi = s1;
+    }
+    double s1 = 0.5*(lo+hi);
+    double ra = d[0]*s1/sqrt(1-s1*s1);
+
+    Vec3d a(c[0], c[1], zW);
+    if (rp > 0) {
+        a[0] += (p[0]-c[0])*ra/rp;
+        a[1] += (p[1]-c[1])*ra/rp;
+    }
+    return a;
+
+}
+
+static Point2d project(const Mat_<double> &P, const Vec3d &a) {
+
+    Mat_<double> X = (Mat_<double>(4,1) << a[0], a[1], a[2], 1);
+    Mat_<double> x = P*X;
+    return Point2d(x(0,0)/x(2,0), x(1,0)/x(2,0));
+
+}
+
+static Point2d project_point(saRefocus &refocus, int cam, const Vec3d &p) {
+
+    Mat_<double> X = (Mat_<double>(3,1) << p[0], p[1], p[2]);
+    Mat_<double> x = refocus.project_point(cam, X);
+    return Point2d(x(0,0), x(1,0));
+
+}
+
+// Bilinear sample with zeros outside the image, like remap with a constant
+// border
+static double sample(const Mat_<float> &img, const Point2d &x) {
+
+    int x0 = cvFloor(x.x), y0 = cvFloor(x.y);
+    double ax = x.x - x0, ay = x.y - y0;
+    double v = 0;
+    for (int dy=0; dy<2; dy++) {
+        for (int dx=0; dx<2; dx++) {
+            if (x0+dx < 0 || x0+dx >= img.cols || y0+dy < 0 || y0+dy >= img.rows)
+                continue;
+            v += (dx ? ax : 1-ax)*(dy ? ay : 1-ay)*img(y0+dy, x0+dx);
+        }
+    }
+    return v;
+
+}
+
+int main(int argc, char** argv) {
+
+    google::ParseCommandLineFlags(&argc, &argv, true);
+    google::InitGoogleLogging(argv[0]);
+    FLAGS_logtostderr=1;
+
+    if (FLAGS_grid < 1)
+        LOG(FATAL) << "The camera grid needs at least one camera per side!";
+
+    RNG rng(0);
+    vector<Vec3d> cams;
+    vector<Mat> Ps;
+    vector< Mat_<float> > views;
+
+    int half = FLAGS_grid/2;
+    for (int j=0; j<FLAGS_grid; j++) {
+        for (int i=0; i<FLAGS_grid; i++) {
+            Vec3d c((i-half)*60.0, (j-half)*60.0, -500.0);
+            cams.push_back(c);
+            Ps.push_back(camera_P(c));
+
+            Mat noise(img_h, img_w, CV_32F), img;
+            rng.fill(noise, RNG::UNIFORM, 0, 1);
+            GaussianBlur(noise, img, Size(0, 0), 4);
+            normalize(img, img, 0, 1, NORM_MINMAX);
+            views.push_back(img);
+        }
+    }
+    int num_cams = cams.size();
+
+    saRefocus refocus;
+    refocus.setGpuMode(FLAGS_gpu);
+    refocus.setHF(0);
+    refocus.setF(f);
+    for (int i=0; i<num_cams; i++)
+        refocus.addView(views[i], Ps[i], Mat(Mat_<double>(1, 3) << cams[i][0], cams[i][1], cams[i][2]));
+    refocus.setRefractive(1, zW, n1, n2, n3, t);
+#ifndef WITHOUT_CUDA
+    if (FLAGS_gpu)
+        refocus.initializeGPU();
+#endif
+
+    // project_point against the independent solver
+    double proj_err = 0;
+    for (int i=0; i<num_cams; i++) {
+        for (int k=0; k<20; k++) {
+            Vec3d p(rng.uniform(-60., 60.), rng.uniform(-40., 40.), rng.uniform(0., 30.));
+            Point2d d = project_point(refocus, i, p) - project(Ps[i], wall_point(cams[i], p));
+            proj_err = max(proj_err, norm(d));
+        }
+    }
+    LOG(INFO) << "Maximum project_point error over " << num_cams << " cameras: " << proj_err << " px";
+
+    // Refocused image against the mean of the views sampled at the
+    // projections of each pixel's world point
+    Mat_<float> out = refocus.refocus(z0, 0, 0, 0, 0, 0);
+    if (out.rows != img_h || out.cols != img_w)
+        LOG(FATAL) << "Unexpected refocused image size " << out.cols << " x " << out.rows << "!";
+
+    double ref_err = 0;
+    int checked = 0;
+    for (int v=4; v<img_h-4; v+=8) {
+        for (int u=4; u<img_w-4; u+=8) {
+            Vec3d p((u - img_w*0.5)/f, (v - img_h*0.5)/f, z0);
+            double sum = 0;
+            bool inside = true;
+            for (int i=0; i<num_cams && inside; i++) {
+                Point2d x = project_point(refocus, i, p);
+                // Pixels sampled near the border of any view depend on how
+                // the border is interpolated
+                inside = x.x >= 2 && x.x < img_w-3 && x.y >= 2 && x.y < img_h-3;
+                sum += sample(views[i], x);
+            }
+            if (!inside)
+                continue;
+            ref_err = max(ref_err, fabs(out(v, u) - sum/num_cams));
+            checked++;
+        }
+    }
+    LOG(INFO) << "Maximum refocusing error over " << checked << " pixels: " << ref_err;
+
+    bool ok = proj_err < FLAGS_proj_tol && checked > 0 && ref_err < FLAGS_refocus_tol;
+    LOG(INFO) << (ok ? "PASS" : "FAIL");
+
+    return ok ? 0 : 1;
+
+}